@@ -29,6 +29,7 @@
 #include "llvm/Support/DynamicLibrary.h"
 #include "llvm/Support/raw_ostream.h"
 #include "llvm/Target/TargetMachine.h"
+#include "hotColdMemoryManager.hpp"
 #include <algorithm>
 #include <memory>
 #include <string>
@@ -43,9 +44,15 @@ namespace llvm {
 			using CompileLayerT = IRCompileLayer<ObjLayerT, SimpleCompiler>;
 			using ModuleHandleT = CompileLayerT::ModuleHandleT;
 
-			KaleidoscopeJIT()
-				: TM(EngineBuilder().selectTarget()), DL(TM->createDataLayout()),
-				ObjectLayer([]() { return std::make_shared<SectionMemoryManager>(); }),
+			KaleidoscopeJIT(const TargetOptions &Options = TargetOptions(),
+				const std::string &CPU = "", const std::vector<std::string> &Features = {})
+				: TM(EngineBuilder().setTargetOptions(Options).setMCPU(CPU).setMAttrs(Features)
+					.selectTarget()),
+				DL(TM->createDataLayout()),
+				HotArena(std::make_shared<CodeArena>()), ColdArena(std::make_shared<CodeArena>()),
+				ObjectLayer([this]() {
+					return std::make_shared<HotColdMemoryManager>(HotArena, ColdArena);
+				}),
 				CompileLayer(ObjectLayer, SimpleCompiler(*TM)) {
 				llvm::sys::DynamicLibrary::LoadLibraryPermanently(nullptr);
 			}
@@ -129,6 +136,8 @@ namespace llvm {
 
 			std::unique_ptr<TargetMachine> TM;
 			const DataLayout DL;
+			// Hot and cold code of every module goes to these.
+			std::shared_ptr<CodeArena> HotArena, ColdArena;
 			ObjLayerT ObjectLayer;
 			CompileLayerT CompileLayer;
 			std::vector<ModuleHandleT> ModuleHandles;
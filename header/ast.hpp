@@ -2,15 +2,33 @@
 #include <string>
 #include <memory>
 #include <vector>
+#include <algorithm>
 #include "llvm\IR\Value.h"
 
 class CodeGen;
 
+/// ValueType - Type of an extern parameter or result in the C signature.
+/// Kaleidoscope numbers are converted to and from it at the call.
+enum class ValueType { Double, Float, I32, I64, Ptr, Void };
+
 /// ExprAST - Base class for all expression nodes.
 class ExprAST {
 public:
 	virtual ~ExprAST() {}
 	virtual llvm::Value* codegen(CodeGen&) = 0;
+	/// isSpeculatable - True when evaluating the expression has no effect but
+	/// its value and takes only a few instructions, so it may be evaluated
+	/// even when the value ends up unused.
+	virtual bool isSpeculatable() const { return false; }
+	/// isSideEffectFree - True when evaluating the expression has no effect
+	/// but its value.  Such expressions are independent of each other, since
+	/// Kaleidoscope has no mutable state.
+	virtual bool isSideEffectFree(const CodeGen&) const { return false; }
+	/// estimateCost - Rough number of instructions executed to evaluate it.
+	virtual unsigned estimateCost(const CodeGen&) const = 0;
+	/// usesVariable - False when the expression certainly does not read the
+	/// variable Name.
+	virtual bool usesVariable(const std::string&) const { return true; }
 };
 
 /// NumberExprAST - Expression class for numeric literals like "1.0".
@@ -19,7 +37,12 @@ class NumberExprAST : public ExprAST {
 
 public:
 	NumberExprAST(double Val) : Val(Val) {}
+	double getVal() const { return Val; }
 	virtual llvm::Value* codegen(CodeGen&) override;
+	bool isSpeculatable() const override { return true; }
+	bool isSideEffectFree(const CodeGen&) const override { return true; }
+	unsigned estimateCost(const CodeGen&) const override { return 0; }
+	bool usesVariable(const std::string&) const override { return false; }
 };
 
 /// VariableExprAST - Expression class for referencing a variable, like "a".
@@ -28,7 +51,33 @@ class VariableExprAST : public ExprAST {
 
 public:
 	VariableExprAST(const std::string &Name) : Name(Name) {}
+	const std::string &getName() const { return Name; }
 	virtual llvm::Value* codegen(CodeGen&) override;
+	bool isSpeculatable() const override { return true; }
+	bool isSideEffectFree(const CodeGen&) const override { return true; }
+	unsigned estimateCost(const CodeGen&) const override { return 0; }
+	bool usesVariable(const std::string& Var) const override { return Var == Name; }
+};
+
+/// UnaryExprAST - Expression class for a unary operator, like "!x".
+class UnaryExprAST : public ExprAST {
+	char Opcode;
+	std::unique_ptr<ExprAST> Operand;
+
+public:
+	UnaryExprAST(char Opcode, std::unique_ptr<ExprAST> Operand)
+		: Opcode(Opcode), Operand(std::move(Operand)) {}
+	virtual llvm::Value* codegen(CodeGen&) override;
+	bool isSpeculatable() const override { return Operand->isSpeculatable(); }
+	bool isSideEffectFree(const CodeGen& codeGen) const override {
+		return Operand->isSideEffectFree(codeGen);
+	}
+	unsigned estimateCost(const CodeGen& codeGen) const override {
+		return 2 + Operand->estimateCost(codeGen);
+	}
+	bool usesVariable(const std::string& Var) const override {
+		return Operand->usesVariable(Var);
+	}
 };
 
 /// BinaryExprAST - Expression class for a binary operator.
@@ -41,6 +90,26 @@ public:
 		std::unique_ptr<ExprAST> RHS)
 		: Op(op), LHS(std::move(LHS)), RHS(std::move(RHS)) {}
 	virtual llvm::Value* codegen(CodeGen&) override;
+	bool isSpeculatable() const override {
+		return LHS->isSpeculatable() && RHS->isSpeculatable();
+	}
+	bool isSideEffectFree(const CodeGen& codeGen) const override {
+		return LHS->isSideEffectFree(codeGen) && RHS->isSideEffectFree(codeGen);
+	}
+	unsigned estimateCost(const CodeGen& codeGen) const override {
+		return 1 + LHS->estimateCost(codeGen) + RHS->estimateCost(codeGen);
+	}
+	bool usesVariable(const std::string& Var) const override {
+		return LHS->usesVariable(Var) || RHS->usesVariable(Var);
+	}
+	/// getLoopBound - Bound when this is 'Var < Bound' with a Bound that does
+	/// not change while Var does, otherwise null.
+	ExprAST* getLoopBound(const std::string& Var, const CodeGen&) const;
+
+private:
+	/// codegenLogical - '&' and '|', which only evaluate RHS when LHS does not
+	/// decide the result.
+	llvm::Value* codegenLogical(CodeGen&);
 };
 
 class IfExprAST :public ExprAST {
@@ -51,6 +120,17 @@ public:
 		: Cond(std::move(Cond)), Then(std::move(Then)), Else(std::move(Else)) {}
 
 	llvm::Value* codegen(CodeGen&) override;
+	bool isSideEffectFree(const CodeGen& codeGen) const override {
+		return Cond->isSideEffectFree(codeGen) && Then->isSideEffectFree(codeGen) &&
+			Else->isSideEffectFree(codeGen);
+	}
+	unsigned estimateCost(const CodeGen& codeGen) const override {
+		return 2 + Cond->estimateCost(codeGen) +
+			std::max(Then->estimateCost(codeGen), Else->estimateCost(codeGen));
+	}
+	bool usesVariable(const std::string& Var) const override {
+		return Cond->usesVariable(Var) || Then->usesVariable(Var) || Else->usesVariable(Var);
+	}
 };
 
 /// ForExprAST - Expression class for for/in.
@@ -66,18 +146,88 @@ public:
 		Step(std::move(Step)), Body(std::move(Body)) {}
 
 	llvm::Value *codegen(CodeGen&) override;
+	bool isSideEffectFree(const CodeGen&) const override;
+	unsigned estimateCost(const CodeGen&) const override;
+};
+
+/// ParallelForExprAST - Expression class for parallel for/in.  The body is
+/// outlined into its own function and the iterations are handed out in
+/// chunks to the runtime thread pool.
+class ParallelForExprAST : public ExprAST {
+	std::string VarName;
+	std::unique_ptr<ExprAST> Start, End, Step, Body;
+
+public:
+	ParallelForExprAST(const std::string &VarName, std::unique_ptr<ExprAST> Start,
+		std::unique_ptr<ExprAST> End, std::unique_ptr<ExprAST> Step,
+		std::unique_ptr<ExprAST> Body)
+		: VarName(VarName), Start(std::move(Start)), End(std::move(End)),
+		Step(std::move(Step)), Body(std::move(Body)) {}
+
+	llvm::Value *codegen(CodeGen&) override;
+	bool isSideEffectFree(const CodeGen&) const override;
+	unsigned estimateCost(const CodeGen&) const override;
+};
+
+/// ReductionExprAST - Expression class for sum/product/min/max, which loop
+/// like for/in and combine the values of the body.
+class ReductionExprAST : public ExprAST {
+public:
+	enum Kind { Sum, Product, Min, Max };
+
+private:
+	Kind Reduction;
+	std::string VarName;
+	std::unique_ptr<ExprAST> Start, End, Step, Body;
+
+public:
+	ReductionExprAST(Kind Reduction, const std::string &VarName,
+		std::unique_ptr<ExprAST> Start, std::unique_ptr<ExprAST> End,
+		std::unique_ptr<ExprAST> Step, std::unique_ptr<ExprAST> Body)
+		: Reduction(Reduction), VarName(VarName), Start(std::move(Start)),
+		End(std::move(End)), Step(std::move(Step)), Body(std::move(Body)) {}
+
+	llvm::Value *codegen(CodeGen&) override;
+	bool isSideEffectFree(const CodeGen&) const override;
+	unsigned estimateCost(const CodeGen&) const override;
 };
 
 /// CallExprAST - Expression class for function calls.
 class CallExprAST : public ExprAST {
 	std::string Callee;
 	std::vector<std::unique_ptr<ExprAST>> Args;
+	bool IsSpawn = false;
 
 public:
 	CallExprAST(const std::string &Callee,
 		std::vector<std::unique_ptr<ExprAST>> Args)
 		: Callee(Callee), Args(std::move(Args)) {}
+	/// setSpawn - Run the call as a task, see 'spawn'.
+	void setSpawn() { IsSpawn = true; }
+	virtual llvm::Value* codegen(CodeGen&) override;
+	bool isSideEffectFree(const CodeGen&) const override;
+	unsigned estimateCost(const CodeGen&) const override;
+	bool usesVariable(const std::string& Var) const override {
+		for (auto& Arg : Args)
+			if (Arg->usesVariable(Var))
+				return true;
+		return false;
+	}
+
+private:
+	/// codegenCall - Emits the call, as a spawned task when Spawn is set.
+	llvm::Value* codegenCall(CodeGen&, bool Spawn);
+	/// isParallelCandidate - True when the call may be evaluated as a task
+	/// alongside the other arguments of the call it is an argument of.
+	bool isParallelCandidate(const CodeGen&) const;
+};
+
+/// SyncExprAST - Expression class for 'sync', which waits for every call the
+/// current function spawned so far.
+class SyncExprAST : public ExprAST {
+public:
 	virtual llvm::Value* codegen(CodeGen&) override;
+	unsigned estimateCost(const CodeGen&) const override { return 1; }
 };
 
 /// PrototypeAST - This class represents the "prototype" for a function,
@@ -86,12 +236,51 @@ public:
 class PrototypeAST {
 	std::string Name;
 	std::vector<std::string> Args;
+	bool IsExtern;
+	bool IsPure = false;
+	bool IsFast = false;
+	bool IsNoUnwind = false;
+	bool IsTyped = false;
+	std::vector<ValueType> ArgTypes;
+	ValueType RetType = ValueType::Double;
+	unsigned Cost = 0;
 
 public:
-	PrototypeAST(const std::string &name, std::vector<std::string> Args)
-		: Name(name), Args(std::move(Args)) {}
+	PrototypeAST(const std::string &name, std::vector<std::string> Args,
+		bool IsExtern = false)
+		: Name(name), Args(std::move(Args)), IsExtern(IsExtern),
+		ArgTypes(this->Args.size(), ValueType::Double) {}
 
 	const std::string &getName() const { return Name; }
+	size_t getNumArgs() const { return Args.size(); }
+	/// isExtern - Externs use the C signature given by their types, by default
+	/// double(double,...), whatever the numeric type is, since they are
+	/// resolved against host functions.
+	bool isExtern() const { return IsExtern; }
+	void setTypes(std::vector<ValueType> ArgTys, ValueType RetTy) {
+		ArgTypes = std::move(ArgTys);
+		RetType = RetTy;
+	}
+	/// isTyped - The extern was written with types, so it can only declare a
+	/// foreign function.
+	bool isTyped() const { return IsTyped; }
+	void setTyped() { IsTyped = true; }
+	/// isPure - 'pure' functions only compute a value from their arguments.  For
+	/// definitions this is checked, for externs it is taken on trust.
+	bool isPure() const { return IsPure; }
+	void setPure() { IsPure = true; }
+	/// isFast - 'fast' functions use every fast-math flag, whatever the session
+	/// is compiled with.
+	bool isFast() const { return IsFast; }
+	void setFast() { IsFast = true; }
+	/// isNoUnwind - The function is known not to unwind, set for definitions
+	/// whose calls can not and for library functions marked so.
+	bool isNoUnwind() const { return IsNoUnwind; }
+	void setNoUnwind() { IsNoUnwind = true; }
+	/// getCost - Estimated cost of a call, set from the body once the function
+	/// is defined.
+	unsigned getCost() const { return Cost; }
+	void setCost(unsigned C) { Cost = C; }
 	virtual llvm::Function* codegen(CodeGen&) ;
 
 };
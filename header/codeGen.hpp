@@ -1,58 +1,478 @@
 #pragma once
 #include "llvm\IR\IRBuilder.h"
 #include "llvm\IR\Value.h"
-#include "llvm\IR\LegacyPassManager.h"
+#include "llvm\IR\PassManager.h"
 #include "KaleidoscopeJIT.hpp"
-#include "llvm\Transforms\InstCombine\InstCombine.h"
-#include "llvm/Transforms/Scalar.h"
-#include "llvm/Transforms/Scalar/GVN.h"
+#include "llvm/Passes/PassBuilder.h"
+#include "llvm/Analysis/TargetLibraryInfo.h"
+#include "llvm/Transforms/Utils/Cloning.h"
+#include "llvm\IR\LegacyPassManager.h"
+#include "llvm/Transforms/IPO.h"
 #include "llvm\Support\TargetSelect.h"
+#include "llvm/Support/Host.h"
+#include "llvm/IRReader/IRReader.h"
+#include "llvm/Support/SourceMgr.h"
 #include "KaleidoscopeJIT.hpp"
 #include "ast.hpp"
+#include "option.hpp"
+#include "inlineLibrary.hpp"
+#include "profile.hpp"
+#include "optReport.hpp"
+#include "runtimeLibrary.hpp"
+#include "logError.hpp"
+#include <cstdio>
+#include <deque>
+
+
+/// ColdRegion - An if arm the profile shows is rarely taken: the blocks of
+/// Function reached from Entry before Merge.
+struct ColdRegion {
+	llvm::Function* function;
+	llvm::BasicBlock* entry;
+	llvm::BasicBlock* merge;
+};
 
+/// Specialization - A function clone for fixed argument values, and how often
+/// its guard sent calls to it.
+struct Specialization {
+	std::string name;
+	uint64_t hits = 0;
+	uint64_t misses = 0;
+};
+
+/// SpawnState - The spawns of the function being generated.
+struct SpawnState {
+	/// frame - Result of kaleido_frame_enter, null until the first spawn.
+	llvm::Value* frame = nullptr;
+	/// bodyBB - Where the frame is opened; the entry block when null.
+	llvm::BasicBlock* bodyBB = nullptr;
+	/// pendingJoins - Join call and the value handed out for each spawn; they
+	/// are inserted right before the first use once the function is complete.
+	std::vector<std::pair<llvm::Instruction*, llvm::Instruction*>> pendingJoins;
+};
 
 class CodeGen {
 public:
-	llvm::LLVMContext theContext;
-	llvm::IRBuilder<> builder;
+	std::unique_ptr<llvm::LLVMContext> theContext;
+	std::unique_ptr<llvm::IRBuilder<>> builder;
 	std::unique_ptr<llvm::Module> theModule;
-	std::unique_ptr<llvm::legacy::FunctionPassManager> theFPM;
 	std::unique_ptr<llvm::orc::KaleidoscopeJIT> theJIT;
 	std::map<std::string, llvm::Value *> namedValues;
 	std::map<std::string, std::unique_ptr<PrototypeAST>> functionProtos;
-	CodeGen():builder(theContext) {
+	/// constants - Values of the 'const' definitions, emitted as immediates.
+	std::map<std::string, double> constants;
+	SpawnState spawnState;
+	/// currentProto - Prototype of the function being generated.
+	const PrototypeAST* currentProto = nullptr;
+	Option option;
+	/// The optimization pipeline and its analysis managers.  They are built
+	/// once and run on every module; cached analyses are dropped in between.
+	std::unique_ptr<llvm::PassBuilder> passBuilder;
+	llvm::LoopAnalysisManager theLAM;
+	llvm::FunctionAnalysisManager theFAM;
+	llvm::CGSCCAnalysisManager theCGAM;
+	llvm::ModuleAnalysisManager theMAM;
+	llvm::ModulePassManager theMPM;
+	InlineLibrary inlineLibrary;
+	Profile profile;
+	/// profileSite - Next counter of the function being generated.
+	unsigned profileSite = 0;
+	/// profiledBranches - Branches of the function being generated weighted
+	/// by the loaded profile.
+	std::vector<llvm::BranchInst*> profiledBranches;
+	/// coldRegions - Cold arms of the function being generated, outlined once
+	/// it is complete.
+	std::vector<ColdRegion> coldRegions;
+	/// specializations - Every specialization made.  Compiled guards count
+	/// into them, so they never move.
+	std::deque<Specialization> specializations;
+	OptReport optReport;
+	/// runtimeEmitted - Runtime library functions the JIT has code for.
+	std::set<std::string> runtimeEmitted;
+	/// libraryFunctions - Functions of the runtime and loaded libraries.
+	std::set<std::string> libraryFunctions;
+	/// foreignFunctions - Whether each function name is foreign, called with
+	/// its C signature and convention, as its first declaration decided.
+	std::map<std::string, bool> foreignFunctions;
+	/// evaluations - Definitions and expressions compiled in the current context.
+	unsigned evaluations = 0;
+	CodeGen(const Option& option = Option()):option(option) {
 		llvm::InitializeNativeTarget();
 		llvm::InitializeNativeTargetAsmParser();
 		llvm::InitializeNativeTargetAsmPrinter();
-		theJIT = std::make_unique<llvm::orc::KaleidoscopeJIT>();
-		theModule = std::make_unique<llvm::Module>("my cool jit", theContext);
+		llvm::TargetOptions Options;
+		Options.GuaranteedTailCallOpt = option.guaranteedTailCalls;
+		std::vector<std::string> Features;
+		std::string CPU = getTargetCPU(Features);
+		theJIT = std::make_unique<llvm::orc::KaleidoscopeJIT>(Options, CPU, Features);
+		initializeContext(std::make_unique<llvm::LLVMContext>());
+		buildPassPipeline();
+		addLibraryFunctions(*buildRuntimeLibrary(*theContext, getRuntimeFunctions()));
+		if (!option.profileUse.empty() && !profile.read(option.profileUse))
+			LogError::LogErrorBase(("can not read profile " + option.profileUse).c_str());
+	}
+
+	/// initializeContext - Generate code in Context from now on.
+	void initializeContext(std::unique_ptr<llvm::LLVMContext> Context) {
+		theModule.reset();
+		builder.reset();
+		theContext = std::move(Context);
+		builder = std::make_unique<llvm::IRBuilder<>>(*theContext);
+		if (!option.optReport.empty())
+			theContext->setDiagnosticHandler(std::make_unique<OptReportHandler>(optReport));
+		InitializeModuleAndPassManager();
+	}
+
+	/// maybeRecycleContext - Count an evaluation, and after -recycle-context
+	/// of them replace the context.  Constants, types and metadata are never
+	/// freed while their context lives, so a long session would grow without
+	/// bound.  Call it only when the current module is empty: the JIT keeps
+	/// just machine code, and the inline library moves its modules over.
+	///
+	/// What outlives the IR still grows with the session: the code and data
+	/// of every definition, which the JIT keeps as later code may call it,
+	/// the specializations, and the profile counters of definitions replaced
+	/// by ones of another shape.  test/contextSoak.sh checks the rest.
+	void maybeRecycleContext() {
+		if (!option.recycleContext || option.wholeProgram || ++evaluations < option.recycleContext)
+			return;
+		evaluations = 0;
+		auto Context = std::make_unique<llvm::LLVMContext>();
+		inlineLibrary.moveToContext(*Context);
+		initializeContext(std::move(Context));
 	}
 
 	void InitializeModuleAndPassManager(void) {
 		// Open a new module.
-		theModule = std::make_unique<llvm::Module>("my cool jit", theContext);
+		theModule = std::make_unique<llvm::Module>("my cool jit", *theContext);
 		theModule->setDataLayout(theJIT->getTargetMachine().createDataLayout());
+	}
+
+	/// getOptLevel - The PassBuilder level of the -O option.
+	llvm::PassBuilder::OptimizationLevel getOptLevel() const {
+		if (option.optSize)
+			return llvm::PassBuilder::Os;
+		switch (option.optLevel) {
+		case 0: return llvm::PassBuilder::O0;
+		case 1: return llvm::PassBuilder::O1;
+		case 3: return llvm::PassBuilder::O3;
+		default: return llvm::PassBuilder::O2;
+		}
+	}
+
+	/// buildPassPipeline - Set up the default per-module pipeline of the -O
+	/// level, with its module, CGSCC, function and loop passes.
+	void buildPassPipeline() {
+		llvm::TargetMachine& TM = theJIT->getTargetMachine();
+		passBuilder = std::make_unique<llvm::PassBuilder>(&TM);
+		// Registered first, so it is used instead of the default library info.
+		llvm::TargetLibraryInfoImpl TLII(TM.getTargetTriple());
+		if (option.vecLib == "SVML")
+			TLII.addVectorizableFunctionsFromVecLib(llvm::TargetLibraryInfoImpl::SVML);
+		else if (option.vecLib == "Accelerate")
+			TLII.addVectorizableFunctionsFromVecLib(llvm::TargetLibraryInfoImpl::Accelerate);
+		theFAM.registerPass([TLII] { return llvm::TargetLibraryAnalysis(TLII); });
+		passBuilder->registerModuleAnalyses(theMAM);
+		passBuilder->registerCGSCCAnalyses(theCGAM);
+		passBuilder->registerFunctionAnalyses(theFAM);
+		passBuilder->registerLoopAnalyses(theLAM);
+		passBuilder->crossRegisterProxies(theLAM, theFAM, theCGAM, theMAM);
 
-		// Create a new pass manager attached to it.
-		theFPM = std::make_unique<llvm::legacy::FunctionPassManager>(theModule.get());
+		// The machine code generator follows the same level.
+		static const llvm::CodeGenOpt::Level CodeGenLevels[] = {
+			llvm::CodeGenOpt::None, llvm::CodeGenOpt::Less,
+			llvm::CodeGenOpt::Default, llvm::CodeGenOpt::Aggressive };
+		TM.setOptLevel(CodeGenLevels[std::min(option.optLevel, 3u)]);
 
-		// Do simple "peephole" optimizations and bit-twiddling optzns.
-		theFPM->add(llvm::createInstructionCombiningPass());
-		// Reassociate expressions.
-		theFPM->add(llvm::createReassociatePass());
-		// Eliminate Common SubExpressions.
-		theFPM->add(llvm::createGVNPass());
-		// Simplify the control flow graph (deleting unreachable blocks, etc).
-		theFPM->add(llvm::createCFGSimplificationPass());
+		// -O0 runs no passes at all.
+		llvm::PassBuilder::OptimizationLevel Level = getOptLevel();
+		if (Level != llvm::PassBuilder::O0)
+			theMPM = passBuilder->buildPerModuleDefaultPipeline(Level);
+	}
+
+	/// runPassPipeline - Optimize the current module.
+	void runPassPipeline() {
+		if (!option.optReport.empty())
+			optReport.countBefore(*theModule);
+		theMPM.run(*theModule, theMAM);
+		if (!option.optReport.empty())
+			optReport.countAfter(*theModule);
+		// The module goes to the JIT next, forget what was computed about it.
+		theLAM.clear();
+		theFAM.clear();
+		theCGAM.clear();
+		theMAM.clear();
+	}
 
-		theFPM->doInitialization();
+	/// optimizeModule - Optimize the current module, which defines Name, with
+	/// the bodies of the small functions it calls available for inlining.  The
+	/// definition is then added to the library in turn.
+	void optimizeModule(const std::string& Name) {
+		if (!option.inlineBudget || getOptLevel() == llvm::PassBuilder::O0) {
+			runPassPipeline();
+			return;
+		}
+		// Top-level expressions run once, nothing inlines them.
+		std::unique_ptr<llvm::Module> Source;
+		if (Name != "__anon_expr")
+			Source = llvm::CloneModule(*theModule);
+		std::set<std::string> Imports = inlineLibrary.importInto(*theModule, option.inlineBudget);
+		runPassPipeline();
+		if (Source)
+			inlineLibrary.add(Name, std::move(Source), *theModule, std::move(Imports));
+	}
+
+	/// optimizeWholeProgram - Optimize the module holding the whole program.
+	/// Only the functions in Roots are called from outside, every other one
+	/// becomes internal so the interprocedural passes see all of its callers.
+	void optimizeWholeProgram(const std::vector<std::string>& Roots) {
+		for (auto& F : *theModule)
+			if (!F.isDeclaration() &&
+				std::find(Roots.begin(), Roots.end(), F.getName()) == Roots.end())
+				F.setLinkage(llvm::GlobalValue::InternalLinkage);
+		runPassPipeline();
+		if (getOptLevel() == llvm::PassBuilder::O0)
+			return;
+
+		// The new pass manager has no function merging yet.
+		llvm::legacy::PassManager MergePM;
+		MergePM.add(llvm::createMergeFunctionsPass());
+		MergePM.run(*theModule);
+	}
+
+	/// getTargetCPU - The CPU to generate code for, and its features.  By
+	/// default the host's, so everything it supports, AVX2, AVX-512 or FMA, can
+	/// be used.  -mcpu and -mattr override them.
+	std::string getTargetCPU(std::vector<std::string>& Features) const {
+		std::string CPU = option.cpu;
+		if (CPU.empty() || CPU == "native") {
+			CPU = llvm::sys::getHostCPUName().str();
+			llvm::StringMap<bool> HostFeatures;
+			if (llvm::sys::getHostCPUFeatures(HostFeatures))
+				for (auto& F : HostFeatures)
+					Features.push_back((F.second ? "+" : "-") + F.first().str());
+		}
+		llvm::SmallVector<llvm::StringRef, 8> Extra;
+		llvm::StringRef(option.cpuFeatures).split(Extra, ',', -1, false);
+		for (llvm::StringRef F : Extra)
+			Features.push_back(F.str());
+		return CPU;
+	}
+
+	/// getCodeSection - Section of the hot or the cold code region of the JIT.
+	const char* getCodeSection(bool Hot) {
+		bool MachO = theJIT->getTargetMachine().getTargetTriple().isOSBinFormatMachO();
+		return Hot ? getHotSection(MachO) : getColdSection(MachO);
+	}
+
+	/// printOptReport - Print the report asked for by -opt-report.
+	void printOptReport() const {
+		if (option.optReport == "json")
+			optReport.printJSON(llvm::errs());
+		else if (option.optReport == "text")
+			optReport.printText(llvm::errs());
+	}
+
+	/// reportSpecializations - Print how often each specialization was used.
+	void reportSpecializations() const {
+		for (auto& S : specializations) {
+			uint64_t Calls = S.hits + S.misses;
+			fprintf(stderr, "specialized %s: %llu of %llu calls hit (%.1f%%)\n", S.name.c_str(),
+				(unsigned long long)S.hits, (unsigned long long)Calls,
+				Calls ? 100.0 * S.hits / Calls : 0.0);
+		}
+	}
+
+	/// getNumTy - The type every Kaleidoscope value is lowered to.
+	llvm::Type* getNumTy() {
+		if (option.useFloat)
+			return llvm::Type::getFloatTy(*theContext);
+		return llvm::Type::getDoubleTy(*theContext);
+	}
+
+	/// getNum - A constant of the numeric type.
+	llvm::Constant* getNum(double Val) {
+		return llvm::ConstantFP::get(getNumTy(), Val);
+	}
+
+	/// getFastMathFlags - Fast-math flags of the floating point operations of
+	/// the function P.
+	llvm::FastMathFlags getFastMathFlags(const PrototypeAST& P) {
+		unsigned Bits = P.isFast() ? FastMathAll : option.fastMath;
+		llvm::FastMathFlags FMF;
+		if (Bits & FastMathReassoc)
+			FMF.setAllowReassoc();
+		if (Bits & FastMathContract)
+			FMF.setAllowContract(true);
+		if (Bits & FastMathNoNaNs)
+			FMF.setNoNaNs();
+		if (Bits & FastMathNoInfs)
+			FMF.setNoInfs();
+		if (Bits & FastMathNoSignedZeros)
+			FMF.setNoSignedZeros();
+		return FMF;
+	}
+
+	/// getValueType - The LLVM type of an extern parameter or result.
+	llvm::Type* getValueType(ValueType Ty) {
+		switch (Ty) {
+		case ValueType::Float: return llvm::Type::getFloatTy(*theContext);
+		case ValueType::I32: return llvm::Type::getInt32Ty(*theContext);
+		case ValueType::I64: return llvm::Type::getInt64Ty(*theContext);
+		case ValueType::Ptr: return llvm::Type::getInt8PtrTy(*theContext);
+		case ValueType::Void: return llvm::Type::getVoidTy(*theContext);
+		default: return llvm::Type::getDoubleTy(*theContext);
+		}
+	}
+
+	/// getValueTypeOf - The extern parameter or result type of the LLVM type
+	/// Ty; false when there is none.
+	static bool getValueTypeOf(llvm::Type* Ty, ValueType& VT) {
+		if (Ty->isDoubleTy())
+			VT = ValueType::Double;
+		else if (Ty->isFloatTy())
+			VT = ValueType::Float;
+		else if (Ty->isIntegerTy(32))
+			VT = ValueType::I32;
+		else if (Ty->isIntegerTy(64))
+			VT = ValueType::I64;
+		else if (Ty->isPointerTy())
+			VT = ValueType::Ptr;
+		else if (Ty->isVoidTy())
+			VT = ValueType::Void;
+		else
+			return false;
+		return true;
+	}
+
+	/// addLibraryFunctions - Declare the functions of Library with a signature
+	/// externs can have like externs, and put all of them in the inline
+	/// library, so calls from definitions can be optimized with their bodies.
+	void addLibraryFunctions(llvm::Module& Library) {
+		Library.setDataLayout(theJIT->getTargetMachine().createDataLayout());
+		for (auto& F : Library) {
+			if (F.isDeclaration() || F.hasLocalLinkage())
+				continue;
+			libraryFunctions.insert(F.getName().str());
+			if (F.isVarArg())
+				continue;
+			ValueType RetTy;
+			std::vector<ValueType> ArgTys(F.arg_size());
+			std::vector<std::string> Args;
+			bool Supported = getValueTypeOf(F.getReturnType(), RetTy);
+			for (auto& Arg : F.args()) {
+				Supported = Supported && getValueTypeOf(Arg.getType(), ArgTys[Arg.getArgNo()]);
+				Args.push_back(Arg.hasName() ? Arg.getName().str() : "a" + std::to_string(Arg.getArgNo()));
+			}
+			if (!Supported)
+				continue;
+			auto Proto = std::make_unique<PrototypeAST>(F.getName().str(), std::move(Args), true);
+			Proto->setTypes(std::move(ArgTys), RetTy);
+			if (F.doesNotAccessMemory())
+				Proto->setPure();
+			if (F.doesNotThrow())
+				Proto->setNoUnwind();
+			functionProtos[F.getName().str()] = std::move(Proto);
+		}
+		inlineLibrary.addLibrary(Library);
+	}
+
+	/// loadLibrary - Load the bitcode or IR file Path into the JIT, with its
+	/// functions added as by addLibraryFunctions.  Returns false on error.
+	bool loadLibrary(const std::string& Path) {
+		llvm::SMDiagnostic Err;
+		std::unique_ptr<llvm::Module> Library = llvm::parseIRFile(Path, Err, *theContext);
+		if (!Library) {
+			LogError::LogErrorBase(("can not load " + Path + ": " + Err.getMessage().str()).c_str());
+			return false;
+		}
+		addLibraryFunctions(*Library);
+		theJIT->addModule(std::move(Library));
+		return true;
+	}
+
+	/// addRuntimeFunctions - Give the JIT code for the runtime library
+	/// functions M still calls after optimization, unless a definition has
+	/// replaced them.  Unused ones are never compiled.
+	void addRuntimeFunctions(const llvm::Module& M) {
+		std::vector<std::string> Missing;
+		for (auto& Name : getRuntimeFunctions()) {
+			const llvm::Function* F = M.getFunction(Name);
+			auto PI = functionProtos.find(Name);
+			bool External = F && (F->isDeclaration() || F->hasAvailableExternallyLinkage());
+			if (External && !F->use_empty() && !runtimeEmitted.count(Name) &&
+				PI != functionProtos.end() && PI->second->isExtern())
+				Missing.push_back(Name);
+		}
+		if (Missing.empty())
+			return;
+		runtimeEmitted.insert(Missing.begin(), Missing.end());
+		std::unique_ptr<llvm::Module> Runtime = buildRuntimeLibrary(*theContext, Missing);
+		Runtime->setDataLayout(theJIT->getTargetMachine().createDataLayout());
+		theJIT->addModule(std::move(Runtime));
+	}
+
+	/// convertNum - Convert V to the type To, e.g. from the numeric type to the
+	/// i32 of an extern's C signature and back.  Integers are signed, pointers
+	/// travel as their address.
+	static llvm::Value* convertNum(llvm::IRBuilder<>& B, llvm::Value* V, llvm::Type* To) {
+		llvm::Type* From = V->getType();
+		if (From == To)
+			return V;
+		llvm::Type* Int64Ty = llvm::Type::getInt64Ty(V->getContext());
+		if (From->isFloatingPointTy()) {
+			if (To->isFloatingPointTy())
+				return B.CreateFPCast(V, To, "fpcast");
+			if (To->isIntegerTy())
+				return B.CreateFPToSI(V, To, "fptosi");
+			return B.CreateIntToPtr(B.CreateFPToUI(V, Int64Ty), To, "inttoptr");
+		}
+		if (From->isIntegerTy())
+			return B.CreateSIToFP(V, To, "sitofp");
+		return B.CreateUIToFP(B.CreatePtrToInt(V, Int64Ty), To, "ptrtofp");
+	}
+
+	llvm::Value* convertNum(llvm::Value* V, llvm::Type* To) {
+		return convertNum(*builder, V, To);
+	}
+
+	/// createEntryBlockAlloca - Create an alloca in the entry block of the
+	/// function being generated, so it is only executed once.
+	llvm::AllocaInst* createEntryBlockAlloca(llvm::Type* Ty, const std::string& Name) {
+		llvm::Function* TheFunction = builder->GetInsertBlock()->getParent();
+		llvm::IRBuilder<> TmpB(&TheFunction->getEntryBlock(),
+			TheFunction->getEntryBlock().begin());
+		return TmpB.CreateAlloca(Ty, nullptr, Name);
 	}
 
 	auto addModuleToJit() {
+		addRuntimeFunctions(*theModule);
 		return theJIT->addModule(std::move(theModule));
 	}
 
 	void removeModuleFromJit(const decltype(theJIT->addModule(std::move(theModule)))& h) {
 		theJIT->removeModule(h);
 	}
+
+	/// refreshDependents - Name was just defined again: compile again every
+	/// function that inlined its old body, and those that inlined them, so the
+	/// JIT binds later calls to the new versions.
+	void refreshDependents(const std::string& Name) {
+		std::vector<std::string> Worklist = inlineLibrary.getDependents(Name);
+		if (Worklist.empty())
+			return;
+		std::set<std::string> Done;
+		while (!Worklist.empty()) {
+			std::string Dependent = Worklist.back();
+			Worklist.pop_back();
+			if (!Done.insert(Dependent).second)
+				continue;
+			theModule = inlineLibrary.cloneSource(Dependent);
+			optimizeModule(Dependent);
+			addModuleToJit();
+			for (auto& D : inlineLibrary.getDependents(Dependent))
+				Worklist.push_back(D);
+		}
+		InitializeModuleAndPassManager();
+	}
 };
\ No newline at end of file
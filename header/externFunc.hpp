@@ -1,22 +0,0 @@
-#pragma once
-#include <cstdio>
-
-
-#ifdef LLVM_ON_WIN32
-#define DLLEXPORT __declspec(dllexport)
-#else
-#define DLLEXPORT
-#endif
-
-
-/// putchard - putchar that takes a double and returns 0.
-extern "C" DLLEXPORT double putchard(double X) {
-	fputc((char)X, stderr);
-	return 0;
-}
-
-/// printd - printf that takes a double prints it as "%f\n", returning 0.
-extern "C" DLLEXPORT double printd(double X) {
-	fprintf(stderr, "%f\n", X);
-	return 0;
-}
@@ -0,0 +1,54 @@
+#pragma once
+#include "llvm/ExecutionEngine/SectionMemoryManager.h"
+#include "llvm/Support/Memory.h"
+#include <map>
+#include <memory>
+#include <utility>
+#include <vector>
+
+/// getHotSection / getColdSection - Name of the section placing a function in
+/// the hot or cold code region of the JIT.  MachO names are segment,section.
+const char* getHotSection(bool MachO);
+const char* getColdSection(bool MachO);
+
+/// CodeArena - Code memory shared by all modules.  Chunks are whole pages
+/// placed at the lowest free address, so the code placed in it stays
+/// together, and chunks given back are reused.  No two chunks share a page:
+/// making one writable again for a new module never touches code that tasks
+/// of earlier modules may still be running.
+class CodeArena {
+	std::vector<llvm::sys::MemoryBlock> slabs;
+	/// freeRanges - Unused ranges of the slabs, by start, with their sizes.
+	std::map<uint8_t*, uintptr_t> freeRanges;
+	/// isSlabStart - Whether P starts a slab; ranges of two slabs are kept
+	/// apart, as their pages are protected separately.
+	bool isSlabStart(const uint8_t* P) const;
+
+public:
+	~CodeArena();
+	/// allocate - A writable chunk of at least Size bytes.
+	llvm::sys::MemoryBlock allocate(uintptr_t Size, unsigned Alignment);
+	/// release - Give back a chunk whose code is no longer used.
+	void release(llvm::sys::MemoryBlock Chunk);
+};
+
+/// HotColdMemoryManager - SectionMemoryManager that allocates the hot and
+/// cold code sections from arenas shared with the other modules.
+class HotColdMemoryManager : public llvm::SectionMemoryManager {
+	std::shared_ptr<CodeArena> hot;
+	std::shared_ptr<CodeArena> cold;
+	/// chunks - Arena chunks of this module, given back when it is removed.
+	std::vector<std::pair<CodeArena*, llvm::sys::MemoryBlock>> chunks;
+	/// pending - Arena chunks of this module, made executable on finalize.
+	std::vector<llvm::sys::MemoryBlock> pending;
+
+public:
+	HotColdMemoryManager(std::shared_ptr<CodeArena> Hot, std::shared_ptr<CodeArena> Cold)
+		: hot(std::move(Hot)), cold(std::move(Cold)) {}
+	~HotColdMemoryManager() override;
+
+	uint8_t* allocateCodeSection(uintptr_t Size, unsigned Alignment, unsigned SectionID,
+		llvm::StringRef SectionName) override;
+
+	bool finalizeMemory(std::string* ErrMsg = nullptr) override;
+};
@@ -0,0 +1,56 @@
+#pragma once
+#include "llvm/IR/Module.h"
+#include <map>
+#include <memory>
+#include <set>
+#include <string>
+#include <vector>
+
+/// InlineLibrary - The IR of the definitions compiled so far.  Every definition
+/// goes to the JIT in a module of its own, so calls between them are external.
+/// Before a module is optimized, the small functions it calls get a copy of
+/// their optimized body as available_externally definitions, which the
+/// inliner may use and which are dropped before code generation.
+///
+/// The IR before optimization is kept as well: when a function is redefined,
+/// the functions that inlined it are compiled again from it.
+class InlineLibrary {
+	struct Entry {
+		/// source - The module of the definition before optimization, null for
+		/// library functions, which are never compiled again.
+		std::unique_ptr<llvm::Module> source;
+		/// optimized - The module of the definition as it went to the JIT.
+		std::unique_ptr<llvm::Module> optimized;
+		/// size - Instructions of the optimized definition, 0 when it refers to
+		/// something only its own module has (memo tables, outlined bodies).
+		unsigned size = 0;
+		/// imports - Functions whose bodies it was optimized with.
+		std::set<std::string> imports;
+	};
+	std::map<std::string, Entry> entries;
+
+public:
+	/// importInto - Copy into M the bodies of the functions it declares whose
+	/// optimized definition has at most Budget instructions, and of those they
+	/// call in turn.  Returns the names of the copied functions.
+	std::set<std::string> importInto(llvm::Module& M, unsigned Budget) const;
+
+	/// add - Record the definition of Name, Source being its module before and
+	/// Optimized after optimization with Imports.
+	void add(const std::string& Name, std::unique_ptr<llvm::Module> Source,
+		const llvm::Module& Optimized, std::set<std::string> Imports);
+
+	/// addLibrary - Record every function Library defines.  Library is
+	/// compiled as it is, its functions are not optimized again.
+	void addLibrary(const llvm::Module& Library);
+
+	/// getDependents - The functions that were optimized with the body of Name.
+	std::vector<std::string> getDependents(const std::string& Name) const;
+
+	/// cloneSource - A copy of the module of Name before optimization.
+	std::unique_ptr<llvm::Module> cloneSource(const std::string& Name) const;
+
+	/// moveToContext - Replace every module with a copy in Context, before the
+	/// context they were created in goes away.
+	void moveToContext(llvm::LLVMContext& Context);
+};
@@ -18,7 +18,11 @@ enum Token {
 	tok_then=-8,
 	tok_else=-9,
 	tok_for=-10,
-	tok_in=-11
+	tok_in=-11,
+	tok_string=-17,
+	// '&&' and '||', with '&' and '|' as thisChar.
+	tok_and=-18,
+	tok_or=-19
 };
 
 struct TokenResult {
@@ -0,0 +1,66 @@
+#pragma once
+#include "llvm/IR/DiagnosticHandler.h"
+#include "llvm/IR/DiagnosticInfo.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Support/raw_ostream.h"
+#include <map>
+#include <string>
+#include <vector>
+
+/// OptReport - What the optimizer did to each source function: the remarks
+/// of its passes, passed, missed or analysis, and the number of instructions
+/// before and after the pipeline.
+///
+/// Functions made from parts of a source function, like outlined code, spawn
+/// thunks or specializations, are reported with it: codegen names their owner
+/// with setSourceFunction when it creates them.
+class OptReport {
+	struct Remark {
+		std::string kind;
+		std::string pass;
+		std::string name;
+		std::string function;
+		std::string message;
+	};
+	struct Counts {
+		unsigned before = 0;
+		unsigned after = 0;
+	};
+	/// remarks - The remarks of each source function, from the last time it
+	/// was optimized.
+	std::map<std::string, std::vector<Remark>> remarks;
+	/// counts - Instruction counts of the functions generated for each source
+	/// function.
+	std::map<std::string, std::map<std::string, Counts>> counts;
+
+public:
+	/// setSourceFunction - Report F with the source function Owner.
+	static void setSourceFunction(llvm::Function& F, llvm::StringRef Owner);
+	/// getSourceFunction - The source function F was generated for.
+	static std::string getSourceFunction(const llvm::Function& F);
+
+	void addRemark(const llvm::DiagnosticInfoIROptimization& R);
+
+	/// countBefore / countAfter - Record the instructions of the functions M
+	/// defines, before and after it is optimized.
+	void countBefore(const llvm::Module& M);
+	void countAfter(const llvm::Module& M);
+
+	void printText(llvm::raw_ostream& OS) const;
+	void printJSON(llvm::raw_ostream& OS) const;
+};
+
+/// OptReportHandler - Enables every optimization remark and hands those of IR
+/// passes to an OptReport.
+class OptReportHandler : public llvm::DiagnosticHandler {
+	OptReport& report;
+
+public:
+	OptReportHandler(OptReport& Report) : report(Report) {}
+
+	bool handleDiagnostics(const llvm::DiagnosticInfo& DI) override;
+	bool isAnalysisRemarkEnabled(llvm::StringRef) const override { return true; }
+	bool isMissedOptRemarkEnabled(llvm::StringRef) const override { return true; }
+	bool isPassedOptRemarkEnabled(llvm::StringRef) const override { return true; }
+	bool isAnyRemarkEnabled() const override { return true; }
+};
@@ -0,0 +1,79 @@
+#pragma once
+#include <string>
+#include <vector>
+
+/// FastMathFlag - Bits of Option::fastMath, each allowing LLVM one of its
+/// fast-math assumptions about floating point operations.
+enum FastMathFlag : unsigned {
+	FastMathReassoc = 1 << 0,
+	FastMathContract = 1 << 1,
+	FastMathNoNaNs = 1 << 2,
+	FastMathNoInfs = 1 << 3,
+	FastMathNoSignedZeros = 1 << 4,
+	FastMathAll = (1 << 5) - 1
+};
+
+/// Option - Session wide compilation settings, filled in from the command line.
+struct Option {
+	/// useFloat - Lower every Kaleidoscope value to float instead of double.
+	bool useFloat = false;
+	/// reassocReductions - Let reductions reassociate their floating point
+	/// operations, so LLVM may turn them into SIMD reductions.
+	bool reassocReductions = false;
+	/// memoize - Give every pure function taking arguments a memo table.
+	bool memoize = false;
+	/// parallelArgs - Evaluate expensive independent call arguments as tasks.
+	bool parallelArgs = false;
+	/// parallelArgThreshold - Estimated cost an argument needs to be worth a
+	/// task, see ExprAST::estimateCost.
+	unsigned parallelArgThreshold = 1000;
+	/// fastMath - FastMathFlag bits set on every floating point operation.
+	unsigned fastMath = 0;
+	/// optLevel - Optimization level, 0 to 3, as in -O2.
+	unsigned optLevel = 2;
+	/// optSize - Optimize for size, -Os.
+	bool optSize = false;
+	/// inlineBudget - Largest earlier definition, in instructions, whose body
+	/// is made available for inlining into later ones; 0 disables it.
+	unsigned inlineBudget = 64;
+	/// wholeProgram - Compile the whole input into one module, optimized and
+	/// run once the input ends.
+	bool wholeProgram = false;
+	/// guaranteedTailCalls - The target guarantees that fastcc calls in tail
+	/// position, those between definitions, do not grow the stack.
+	bool guaranteedTailCalls = false;
+	/// vecLib - Vector math library vectorized loops may call, "SVML" or
+	/// "Accelerate"; its functions must be loaded into the process. "none",
+	/// like leaving it empty, keeps math calls scalar.
+	std::string vecLib;
+	/// profileGenerate - Count the branches taken and save the counts here
+	/// once the input ends.
+	std::string profileGenerate;
+	/// profileUse - Weight branches with counts saved by -profile-generate.
+	std::string profileUse;
+	/// hotThreshold - Calls in the profile that make a function hot, placing
+	/// it in the hot code region.
+	unsigned hotThreshold = 1000;
+	/// specialize - Clone hot functions for the argument values the profile
+	/// shows they are nearly always called with.  The profile is the one
+	/// read by -profile-use, so specialization happens when a later session
+	/// compiles the definitions, never while the profiled one runs: code the
+	/// JIT has emitted is not replaced, and callers are bound to it.
+	bool specialize = false;
+	/// cpu - CPU the JIT generates code for, the host CPU when empty or "native".
+	std::string cpu;
+	/// cpuFeatures - Comma separated features added to or removed from those
+	/// of the CPU, like "+avx2,-avx512f".
+	std::string cpuFeatures;
+	/// optReport - Report the optimization remarks and instruction counts of
+	/// every function at the end, as "text" or "json"; off when empty.
+	std::string optReport;
+	/// recycleContext - Evaluations after which the LLVMContext is replaced
+	/// by a new one, freeing what it accumulated; never when 0.
+	unsigned recycleContext = 1000;
+	/// libs - Bitcode or IR files loaded before the input, like 'load'.
+	std::vector<std::string> libs;
+};
+
+/// parseOption - Build an Option from the program arguments.
+Option parseOption(int argc, char* argv[]);
@@ -17,12 +17,16 @@ class Parser {
 	/// defined.
 	std::map<char, int> binopPrecedence;
 	std::unique_ptr<CodeGen> codeGen;
+	/// anonExprs - Top-level expressions of the whole program, in order.
+	std::vector<std::string> anonExprs;
 
 public:
 
 	Parser(std::unique_ptr<CodeGen>&& codeGen):codeGen(std::move(codeGen)) {
 		// Install standard binary operators.
 		// 1 is lowest precedence.
+		binopPrecedence['|'] = 5;  // '||'
+		binopPrecedence['&'] = 6;  // '&&'
 		binopPrecedence['<'] = 10;
 		binopPrecedence['+'] = 20;
 		binopPrecedence['-'] = 20;
@@ -43,13 +47,19 @@ private:
 	///   ::= identifier
 	///   ::= identifier '(' expression* ')'
 	std::unique_ptr<ExprAST> ParseIdentifierExpr();
+	/// The rest of an identifierexpr, whose identifier IdName is eaten.
+	std::unique_ptr<ExprAST> ParseIdentifierExpr(const std::string& IdName);
 
 	/// primary
 	///   ::= identifierexpr
 	///   ::= numberexpr
 	///   ::= parenexpr
+	///   ::= unaryexpr
 	std::unique_ptr<ExprAST> ParsePrimary();
 
+	/// unaryexpr ::= '!' primary
+	std::unique_ptr<ExprAST> ParseUnaryExpr();
+
 	/// GetTokPrecedence - Get the precedence of the pending binary operator token.
 	int GetTokPrecedence();
 
@@ -63,8 +73,14 @@ private:
 	std::unique_ptr<ExprAST> Parser::ParseBinOpRHS(int ExprPrec, std::unique_ptr<ExprAST> LHS);
 
 	/// prototype
-	///   ::= id '(' id* ')'
-	std::unique_ptr<PrototypeAST> ParsePrototype();
+	///   ::= qualifier* id '(' (id (':' type)?)* ')' (':' type)?
+	/// qualifier ::= 'pure' | 'fast'
+	/// Types are only allowed on externs.
+	std::unique_ptr<PrototypeAST> ParsePrototype(bool IsExtern = false);
+
+	/// type ::= 'double' | 'float' | 'i32' | 'i64' | 'ptr' | 'void'
+	/// Parses the type after ':' into Ty, returns false on error.
+	bool ParseType(ValueType& Ty);
 
 	/// definition ::= 'def' prototype expression
 	std::unique_ptr<FunctionAST> ParseDefinition();
@@ -73,14 +89,42 @@ private:
 	std::unique_ptr<PrototypeAST> ParseExtern();
 
 	/// toplevelexpr ::= expression
-	std::unique_ptr<FunctionAST> ParseTopLevelExpr();
+	/// LHS is its first primary when already parsed.
+	std::unique_ptr<FunctionAST> ParseTopLevelExpr(std::unique_ptr<ExprAST> LHS = nullptr);
+
+	/// constdef ::= 'const' identifier '=' expression
+	/// Called with 'const' eaten.  Returns the expression as an anonymous
+	/// function and its name in Name.
+	std::unique_ptr<FunctionAST> ParseConst(std::string& Name);
+
+	/// load ::= 'load' string
+	/// Called with 'load' eaten.  Returns false on error, the file name in
+	/// Path otherwise.
+	bool ParseLoad(std::string& Path);
 
 	std::unique_ptr<ExprAST> ParseIfExpr();
 
 	/// forexpr ::= 'for' identifier '=' expr ',' expr (',' expr)? 'in' expression
 	std::unique_ptr<ExprAST> ParseForExpr();
 
-	/// top ::= definition | external | expression | ';'
+	/// parallelforexpr
+	///   ::= 'parallel' 'for' identifier '=' expr ',' identifier '<' expr (',' expr)? 'in' expression
+	/// Called with 'parallel' eaten.
+	std::unique_ptr<ExprAST> ParseParallelForExpr();
+
+	/// reductionexpr
+	///   ::= ('sum' | 'product' | 'min' | 'max') identifier '=' expr ',' expr (',' expr)? 'in' expression
+	std::unique_ptr<ExprAST> ParseReductionExpr(ReductionExprAST::Kind Reduction);
+
+	/// spawnexpr ::= 'spawn' identifier '(' expression* ')'
+	/// Called with 'spawn' eaten.
+	std::unique_ptr<ExprAST> ParseSpawnExpr();
+
+	/// syncexpr ::= 'sync'
+	/// Called with 'sync' eaten.  A variable or constant named sync hides it.
+	std::unique_ptr<ExprAST> ParseSyncExpr();
+
+	/// top ::= definition | external | constdef | load | expression | ';'
 public : 
 	void MainLoop();
 	void Do();
@@ -90,6 +134,25 @@ private:
 
 	void HandleExtern();
 
-	void HandleTopLevelExpression();
+	void HandleConst();
+
+	void HandleLoad();
+
+	/// HandleIdentifier - A top-level item starting with a name: 'const' and
+	/// 'load' commands, or an expression.
+	void HandleIdentifier();
+
+	void HandleTopLevelExpression(std::unique_ptr<ExprAST> LHS = nullptr);
+
+	/// EvaluateAnonExpr - Compile and run an anonymous function made by
+	/// ParseTopLevelExpr or ParseConst, returns false on error.
+	bool EvaluateAnonExpr(FunctionAST& FnAST, double& Result);
+
+	/// CallAnonExpr - Run the JIT compiled top-level expression Name.
+	double CallAnonExpr(const std::string& Name);
+
+	/// HandleWholeProgram - Optimize the program read in whole program mode,
+	/// then run its top-level expressions.
+	void HandleWholeProgram();
 
 };
\ No newline at end of file
@@ -0,0 +1,70 @@
+#pragma once
+#include <cstdint>
+#include <map>
+#include <string>
+#include <vector>
+
+/// Profile - Execution counts of the definitions, per function in the order
+/// codegen reaches its counter sites: the entry, a value table for every
+/// argument, then two counters (taken, not taken) for every conditional branch.
+///
+/// A value table is ValueTableSize counters: the number of calls, then
+/// ValueSlots pairs (value bits, count) of the values seen most often, kept by
+/// kaleido_profile_value.
+///
+/// Instrumented code increments counters in host memory directly, a later
+/// compile reads the counts back to weight the same branches.  A record holds
+/// one count per site, so its length tells whether it was made for the
+/// definition being compiled.
+class Profile {
+	typedef std::vector<std::vector<uint64_t>> Counters;
+	/// counters - Counters of the current definition of each function, in
+	/// groups allocated together.  Moving a vector keeps its elements in place,
+	/// so their addresses can be compiled in.
+	std::map<std::string, Counters> counters;
+	/// spare - Groups of the replaced definition of each function, handed on
+	/// to the new one while it asks for groups of the same sizes.  The old
+	/// code, which may still run, then counts into the record being written.
+	std::map<std::string, std::pair<Counters, size_t>> spare;
+	/// retired - Groups the new definition did not take over; their code may
+	/// still run, so they live as long as the profile.
+	Counters retired;
+	/// retireSpare - Retire the groups of Name no longer handed on.
+	void retireSpare(const std::string& Name);
+	/// loaded - Counts read by read().
+	std::map<std::string, std::vector<uint64_t>> loaded;
+
+public:
+	/// beginFunction - Start counting a new definition of Name.
+	void beginFunction(const std::string& Name);
+
+	static const unsigned ValueSlots = 4;
+	static const unsigned ValueTableSize = 1 + 2 * ValueSlots;
+
+	/// addCounter - A new counter of the definition of Name.
+	uint64_t* addCounter(const std::string& Name) { return addCounters(Name, 1); }
+
+	/// addCounters - N new adjacent counters of the definition of Name.
+	uint64_t* addCounters(const std::string& Name, unsigned N);
+
+	/// getCount - The loaded count of counter Site of Name, or -1 when the
+	/// profile has none.
+	int64_t getCount(const std::string& Name, unsigned Site) const;
+
+	/// fits - False when the loaded record of Name has another number of
+	/// sites than Sites, those of the definition being compiled: it was made
+	/// for another version and its counts do not apply.
+	bool fits(const std::string& Name, unsigned Sites) const;
+
+	/// getTopValue - The value seen most often by the loaded value table at
+	/// Site of Name, with its count and the number of calls.  Returns false
+	/// when the profile has no such table or it saw no calls.
+	bool getTopValue(const std::string& Name, unsigned Site,
+		uint64_t& Value, uint64_t& Count, uint64_t& Total) const;
+
+	/// write - Save the counters as lines "name count...", returns false on error.
+	bool write(const std::string& FileName) const;
+
+	/// read - Load counts saved by write, returns false on error.
+	bool read(const std::string& FileName);
+};
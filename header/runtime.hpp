@@ -0,0 +1,49 @@
+#pragma once
+#include <cstdint>
+#include "llvm/Config/llvm-config.h"
+
+
+#ifndef DLLEXPORT
+#ifdef LLVM_ON_WIN32
+#define DLLEXPORT __declspec(dllexport)
+#else
+#define DLLEXPORT
+#endif
+#endif
+
+/// Runtime support called from JIT compiled code.  The symbols are resolved
+/// through the host process.
+
+/// kaleido_parallel_for - Run Body over the iterations [0, Count) on the worker
+/// pool.  Body is called with chunks [Begin, End) and the captured Env.
+extern "C" DLLEXPORT void kaleido_parallel_for(
+	void(*Body)(int64_t Begin, int64_t End, void* Env), int64_t Count, void* Env);
+
+/// kaleido_frame_enter - Open the frame that owns the tasks spawned by one
+/// call of a function using spawn.
+extern "C" DLLEXPORT void* kaleido_frame_enter();
+
+/// kaleido_spawn - Start Thunk(Args) as a task other threads may steal, or run
+/// it right away when the calling thread already has enough tasks waiting.
+/// The arguments are copied, the task lives until its frame is left.
+extern "C" DLLEXPORT void* kaleido_spawn(
+	void* Frame, double(*Thunk)(const double* Args), const double* Args, int64_t NumArgs);
+
+/// kaleido_join - Wait for a spawned task and return its value.
+extern "C" DLLEXPORT double kaleido_join(void* Task);
+
+/// kaleido_sync - Wait for every task spawned in the frame so far.
+extern "C" DLLEXPORT void kaleido_sync(void* Frame);
+
+/// kaleido_frame_leave - Sync and release the frame.
+extern "C" DLLEXPORT void kaleido_frame_leave(void* Frame);
+
+/// kaleido_profile_value - Count a call with argument bits Value in the value
+/// table Table, laid out as described by Profile.
+extern "C" DLLEXPORT void kaleido_profile_value(uint64_t* Table, uint64_t Value);
+
+/// kaleido_print_char - Write the character C to stderr, for putchard.
+extern "C" DLLEXPORT void kaleido_print_char(int32_t C);
+
+/// kaleido_print_double - Write X as "%f\n" to stderr, for printd.
+extern "C" DLLEXPORT void kaleido_print_double(double X);
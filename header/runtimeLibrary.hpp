@@ -0,0 +1,27 @@
+#pragma once
+#include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/Module.h"
+#include <memory>
+#include <set>
+#include <string>
+#include <vector>
+
+/// The built-in runtime library: putchard, printd and numeric helpers, all
+/// double(double,...) like externs.  They are IR, so the optimizer sees their
+/// bodies; only the output itself is done by the host, through kaleido_print_char
+/// and kaleido_print_double.
+///
+///   putchard(x)        print the character x, returns 0
+///   printd(x)          print x as "%f\n", returns 0
+///   min(a, b)          the smaller of a and b
+///   max(a, b)          the larger of a and b
+///   clamp(x, lo, hi)   x limited to [lo, hi]
+///   sign(x)            -1, 0 or 1
+///   lerp(a, b, t)      a + (b - a) * t
+
+/// getRuntimeFunctions - Names of the functions of the runtime library.
+const std::vector<std::string>& getRuntimeFunctions();
+
+/// buildRuntimeLibrary - A module defining the runtime functions in Names.
+std::unique_ptr<llvm::Module> buildRuntimeLibrary(llvm::LLVMContext& Context,
+	const std::vector<std::string>& Names);
@@ -6,37 +6,872 @@
 #include "llvm/IR/Verifier.h"
 #include "llvm/IR/Function.h"
 #include "llvm/IR/Value.h"
+#include "llvm/IR/Intrinsics.h"
+#include "llvm/IR/Dominators.h"
+#include "llvm/IR/MDBuilder.h"
+#include "llvm/IR/InstIterator.h"
+#include "llvm/Transforms/Utils/Cloning.h"
+#include "llvm/Transforms/Utils/CodeExtractor.h"
+#include "llvm/ADT/SmallPtrSet.h"
+#include <algorithm>
+#include <cmath>
+#include <sstream>
+
+/// getSpawnFrame - The runtime frame of the function being generated, opened
+/// at the top of its entry block on the first spawn.
+static llvm::Value* getSpawnFrame(CodeGen& codeGen) {
+	if (codeGen.spawnState.frame)
+		return codeGen.spawnState.frame;
+	llvm::Function* TheFunction = codeGen.builder->GetInsertBlock()->getParent();
+	llvm::FunctionType* EnterFT = llvm::FunctionType::get(
+		llvm::Type::getInt8PtrTy(*codeGen.theContext), false);
+	llvm::Constant* EnterF = codeGen.theModule->getOrInsertFunction("kaleido_frame_enter", EnterFT);
+	llvm::BasicBlock* BodyBB = codeGen.spawnState.bodyBB;
+	if (!BodyBB)
+		BodyBB = &TheFunction->getEntryBlock();
+	llvm::IRBuilder<> TmpB(BodyBB, BodyBB->getFirstInsertionPt());
+	return codeGen.spawnState.frame = TmpB.CreateCall(EnterF, {}, "frame");
+}
+
+/// getSpawnThunk - double Caller.spawn.Callee(double* Args), the entry point
+/// the runtime calls for a spawned call of CalleeF in the function being
+/// generated.
+static llvm::Function* getSpawnThunk(llvm::Function* CalleeF, CodeGen& codeGen) {
+	const std::string& Caller = codeGen.currentProto->getName();
+	std::string Name = Caller + ".spawn." + CalleeF->getName().str();
+	if (auto* F = codeGen.theModule->getFunction(Name))
+		return F;
+
+	llvm::Type* DoubleTy = llvm::Type::getDoubleTy(*codeGen.theContext);
+	llvm::FunctionType* FT = llvm::FunctionType::get(DoubleTy, { DoubleTy->getPointerTo() }, false);
+	llvm::Function* F = llvm::Function::Create(FT, llvm::Function::InternalLinkage,
+		Name, codeGen.theModule.get());
+	OptReport::setSourceFunction(*F, Caller);
+	llvm::IRBuilder<> B(llvm::BasicBlock::Create(*codeGen.theContext, "entry", F));
+	llvm::Value* ArgsPtr = &*F->arg_begin();
+	std::vector<llvm::Value*> ArgsV;
+	for (unsigned i = 0, e = CalleeF->arg_size(); i != e; ++i) {
+		llvm::Value* ArgV = B.CreateLoad(DoubleTy, B.CreateConstInBoundsGEP1_32(DoubleTy, ArgsPtr, i));
+		ArgsV.push_back(CodeGen::convertNum(B, ArgV, CalleeF->getFunctionType()->getParamType(i)));
+	}
+	llvm::CallInst* CallV = B.CreateCall(CalleeF, ArgsV);
+	CallV->setCallingConv(CalleeF->getCallingConv());
+	if (CallV->getType()->isVoidTy())
+		B.CreateRet(llvm::ConstantFP::get(DoubleTy, 0.0));
+	else
+		B.CreateRet(CodeGen::convertNum(B, CallV, DoubleTy));
+	return F;
+}
+
+/// spawnCall - Start CalleeF(ArgsV) as a task.  The join is not inserted yet,
+/// finishSpawns puts it right before the first use of the value so the work
+/// between the spawn and that use runs in parallel with the task.
+static llvm::Value* spawnCall(llvm::Function* CalleeF, const std::vector<llvm::Value*>& ArgsV,
+	CodeGen& codeGen) {
+	llvm::Type* DoubleTy = llvm::Type::getDoubleTy(*codeGen.theContext);
+	llvm::Type* BytePtrTy = llvm::Type::getInt8PtrTy(*codeGen.theContext);
+	llvm::Type* Int64Ty = llvm::Type::getInt64Ty(*codeGen.theContext);
+	llvm::Value* Frame = getSpawnFrame(codeGen);
+
+	// The runtime copies the arguments, so one buffer per call site will do.
+	llvm::Type* ArgsTy = llvm::ArrayType::get(DoubleTy, std::max<size_t>(ArgsV.size(), 1));
+	llvm::AllocaInst* Args = codeGen.createEntryBlockAlloca(ArgsTy, "spawnargs");
+	for (unsigned i = 0, e = ArgsV.size(); i != e; ++i)
+		codeGen.builder->CreateStore(codeGen.convertNum(ArgsV[i], DoubleTy),
+			codeGen.builder->CreateConstInBoundsGEP2_32(ArgsTy, Args, 0, i));
+
+	llvm::Function* Thunk = getSpawnThunk(CalleeF, codeGen);
+	llvm::FunctionType* SpawnFT = llvm::FunctionType::get(BytePtrTy,
+		{ BytePtrTy, Thunk->getType(), DoubleTy->getPointerTo(), Int64Ty }, false);
+	llvm::Constant* SpawnF = codeGen.theModule->getOrInsertFunction("kaleido_spawn", SpawnFT);
+	llvm::Value* Task = codeGen.builder->CreateCall(SpawnF,
+		{ Frame, Thunk, codeGen.builder->CreateConstInBoundsGEP2_32(ArgsTy, Args, 0, 0),
+		llvm::ConstantInt::get(Int64Ty, ArgsV.size()) }, "task");
+
+	llvm::FunctionType* JoinFT = llvm::FunctionType::get(DoubleTy, { BytePtrTy }, false);
+	llvm::Constant* JoinF = codeGen.theModule->getOrInsertFunction("kaleido_join", JoinFT);
+	llvm::Instruction* Join = llvm::CallInst::Create(JoinF, { Task }, "spawnval");
+	llvm::Instruction* Result = Join;
+	if (codeGen.getNumTy() != DoubleTy)
+		Result = llvm::CastInst::CreateFPCast(Join, codeGen.getNumTy(), "fpcast");
+	codeGen.spawnState.pendingJoins.push_back({ Join, Result });
+	return Result;
+}
+
+/// finishSpawns - Place the pending joins of the function and leave its frame
+/// before Ret.  Called once the function is complete.
+static void finishSpawns(llvm::Function* TheFunction, llvm::ReturnInst* Ret, CodeGen& codeGen) {
+	SpawnState& State = codeGen.spawnState;
+	if (!State.frame)
+		return;
+
+	llvm::DominatorTree DT(*TheFunction);
+	for (auto& PJ : State.pendingJoins) {
+		llvm::Instruction* Join = PJ.first;
+		llvm::Instruction* Result = PJ.second;
+		if (Result->use_empty()) {
+			// Value unused, leaving the frame waits for the task.
+			if (Result != Join)
+				Result->deleteValue();
+			Join->deleteValue();
+			continue;
+		}
+
+		// Join in the block dominating every use: before the first use there,
+		// or at its end when the uses are further down (or are PHI operands).
+		llvm::BasicBlock* DomBB = nullptr;
+		llvm::SmallPtrSet<llvm::Instruction*, 4> Users;
+		for (llvm::User* U : Result->users()) {
+			auto* UI = llvm::cast<llvm::Instruction>(U);
+			llvm::BasicBlock* UseBB = UI->getParent();
+			if (auto* PN = llvm::dyn_cast<llvm::PHINode>(UI)) {
+				for (unsigned i = 0, e = PN->getNumIncomingValues(); i != e; ++i)
+					if (PN->getIncomingValue(i) == Result)
+						DomBB = DomBB ? DT.findNearestCommonDominator(DomBB, PN->getIncomingBlock(i))
+						: PN->getIncomingBlock(i);
+				continue;
+			}
+			Users.insert(UI);
+			DomBB = DomBB ? DT.findNearestCommonDominator(DomBB, UseBB) : UseBB;
+		}
+		llvm::Instruction* InsertPt = DomBB->getTerminator();
+		for (auto& I : *DomBB)
+			if (Users.count(&I)) {
+				InsertPt = &I;
+				break;
+			}
+		Join->insertBefore(InsertPt);
+		if (Result != Join)
+			Result->insertAfter(Join);
+	}
+	State.pendingJoins.clear();
+
+	llvm::FunctionType* LeaveFT = llvm::FunctionType::get(llvm::Type::getVoidTy(*codeGen.theContext),
+		{ llvm::Type::getInt8PtrTy(*codeGen.theContext) }, false);
+	llvm::Constant* LeaveF = codeGen.theModule->getOrInsertFunction("kaleido_frame_leave", LeaveFT);
+	llvm::CallInst::Create(LeaveF, { State.frame }, "", Ret);
+}
+
+/// MaxCost - Cap on cost estimates, which keeps nested loops from overflowing.
+static const unsigned MaxCost = 1u << 24;
+/// LoopCostFactor - Assumed trip count of a loop whose bounds are not known.
+static const unsigned LoopCostFactor = 100;
+/// ExternCallCost - Assumed cost of calling a host function.
+static const unsigned ExternCallCost = 20;
+static unsigned loopCost(unsigned Bounds, unsigned Body) {
+	return std::min<uint64_t>(MaxCost, Bounds + uint64_t(Body) * LoopCostFactor);
+}
+
+/// MaxTripCount - Cap on computed trip counts, far more iterations than any
+/// loop runs, and exact in float as well as double.
+static const double MaxTripCount = 4611686018427387904.0;  // 2^62
+
+/// emitTripCount - Iterations of a loop from StartVal by StepVal that runs the
+/// body and then tests 'Var < EndVal': max(0, ceil((End - Start) / Step)) + 1.
+/// The span is clamped before it is converted, a NaN to 0 as the compare
+/// fails on it, an infinite or huge one to MaxTripCount.
+static llvm::Value* emitTripCount(llvm::Value* StartVal, llvm::Value* EndVal, llvm::Value* StepVal,
+	CodeGen& codeGen) {
+	llvm::Type* Int64Ty = llvm::Type::getInt64Ty(*codeGen.theContext);
+	llvm::Value* Span = codeGen.builder->CreateFDiv(
+		codeGen.builder->CreateFSub(EndVal, StartVal, "span"), StepVal, "span");
+	llvm::Function* CeilF = llvm::Intrinsic::getDeclaration(
+		codeGen.theModule.get(), llvm::Intrinsic::ceil, { codeGen.getNumTy() });
+	Span = codeGen.builder->CreateCall(CeilF, { Span });
+	Span = codeGen.builder->CreateSelect(codeGen.builder->CreateFCmpOGT(Span, codeGen.getNum(0.0)),
+		Span, codeGen.getNum(0.0));
+	llvm::Value* Max = codeGen.getNum(MaxTripCount);
+	Span = codeGen.builder->CreateSelect(codeGen.builder->CreateFCmpOLT(Span, Max), Span, Max, "span");
+	llvm::Value* TripCount = codeGen.builder->CreateFPToSI(Span, Int64Ty, "tripcount");
+	return codeGen.builder->CreateAdd(
+		TripCount, llvm::ConstantInt::get(Int64Ty, 1), "tripcount");
+}
+
+/// LoopInduction - The loop variable of for/in and reductions.  When End is
+/// 'Var < Bound' with Bound loop invariant and Step a positive integer, the
+/// trip count is known on entry: the loop then counts an i64 index up to it
+/// and derives Var as Start + Index * Step, which is the canonical form the
+/// loop passes (LICM, IndVarSimplify, unrolling, vectorization) work on.
+/// Otherwise Var is stepped and End tested after every iteration.
+class LoopInduction {
+	const std::string& VarName;
+	ExprAST* End;
+	ExprAST* Step;
+	llvm::Value* StartVal = nullptr;
+	llvm::Value* StepVal = nullptr;
+	llvm::Value* TripCount = nullptr;
+	llvm::PHINode* Phi = nullptr;
+	llvm::Value* Variable = nullptr;
+	llvm::Value* Next = nullptr;
+
+public:
+	LoopInduction(const std::string& VarName, ExprAST* End, ExprAST* Step)
+		: VarName(VarName), End(End), Step(Step) {}
+
+	/// emitPreheader - Called before the loop; computes the trip count of
+	/// counted loops.
+	bool emitPreheader(llvm::Value* Start, CodeGen& codeGen) {
+		StartVal = Start;
+		auto* StepNum = dynamic_cast<NumberExprAST*>(Step);
+		if (Step && !(StepNum && StepNum->getVal() >= 1 &&
+			StepNum->getVal() == std::floor(StepNum->getVal())))
+			return true;
+		auto* Cmp = dynamic_cast<BinaryExprAST*>(End);
+		ExprAST* Bound = Cmp ? Cmp->getLoopBound(VarName, codeGen) : nullptr;
+		if (!Bound)
+			return true;
+		llvm::Value* BoundVal = Bound->codegen(codeGen);
+		if (!BoundVal)
+			return false;
+		StepVal = codeGen.getNum(StepNum ? StepNum->getVal() : 1.0);
+		TripCount = emitTripCount(StartVal, BoundVal, StepVal, codeGen);
+		return true;
+	}
+
+	/// emitVariable - Called at the top of the loop header, returns Var.
+	llvm::Value* emitVariable(llvm::BasicBlock* PreheaderBB, CodeGen& codeGen) {
+		if (TripCount) {
+			llvm::Type* Int64Ty = llvm::Type::getInt64Ty(*codeGen.theContext);
+			Phi = codeGen.builder->CreatePHI(Int64Ty, 2, "index");
+			Phi->addIncoming(llvm::ConstantInt::get(Int64Ty, 0), PreheaderBB);
+			return Variable = codeGen.builder->CreateFAdd(StartVal, codeGen.builder->CreateFMul(
+				codeGen.builder->CreateSIToFP(Phi, codeGen.getNumTy()), StepVal), VarName);
+		}
+		Phi = codeGen.builder->CreatePHI(codeGen.getNumTy(), 2, VarName);
+		Phi->addIncoming(StartVal, PreheaderBB);
+		return Variable = Phi;
+	}
+
+	/// emitCondition - Called after the body, returns whether to loop again.
+	llvm::Value* emitCondition(CodeGen& codeGen) {
+		if (TripCount) {
+			Next = codeGen.builder->CreateAdd(Phi,
+				llvm::ConstantInt::get(Phi->getType(), 1), "nextindex");
+			return codeGen.builder->CreateICmpSLT(Next, TripCount, "loopcond");
+		}
+
+		// Emit the step value.
+		if (Step) {
+			StepVal = Step->codegen(codeGen);
+			if (!StepVal)
+				return nullptr;
+		}
+		else {
+			// If not specified, use 1.0.
+			StepVal = codeGen.getNum(1.0);
+		}
+		Next = codeGen.builder->CreateFAdd(Variable, StepVal, "nextvar");
+
+		// Compute the end condition.
+		llvm::Value *EndCond = End->codegen(codeGen);
+		if (!EndCond)
+			return nullptr;
+
+		// Convert condition to a bool by comparing non-equal to 0.0.
+		return codeGen.builder->CreateFCmpONE(
+			EndCond, codeGen.getNum(0.0), "loopcond");
+	}
+
+	/// addBackedge - Called once the branch back from LoopEndBB is in place.
+	void addBackedge(llvm::BasicBlock* LoopEndBB) {
+		Phi->addIncoming(Next, LoopEndBB);
+	}
+};
+
+/// MemoTableSize - Number of entries in the memo table of a pure function.
+static const unsigned MemoTableSize = 1024;
+
+/// MemoSlot - The memo table entry picked for the arguments of a call.
+struct MemoSlot {
+	llvm::Type* EntryTy;
+	llvm::Value* Entry;
+	std::vector<llvm::Value*> Keys;
+};
+
+/// emitMemoLookup - Return early with the remembered value when the memo table
+/// of the function holds one for these arguments.  The table is direct mapped
+/// on a hash of the argument bits and has no locks, as the function may run
+/// in tasks on several threads at once: each entry is a seqlock, whose
+/// version is odd while a store writes it and 0 while it is empty.  A lookup
+/// that sees the version change while it reads the entry misses.  Leaves the
+/// builder in the block where the body goes.
+static MemoSlot emitMemoLookup(llvm::Function* TheFunction, CodeGen& codeGen) {
+	llvm::Type* Int64Ty = llvm::Type::getInt64Ty(*codeGen.theContext);
+	llvm::Type* NumTy = codeGen.getNumTy();
+	llvm::Type* BitsTy = llvm::Type::getIntNTy(*codeGen.theContext, NumTy->getPrimitiveSizeInBits());
+	MemoSlot Slot;
+
+	// Entries are { version, [N x argument bits], value bits }, all accessed
+	// atomically.
+	llvm::Type* KeysTy = llvm::ArrayType::get(Int64Ty, TheFunction->arg_size());
+	Slot.EntryTy = llvm::StructType::get(*codeGen.theContext, { Int64Ty, KeysTy, BitsTy });
+	llvm::Type* TableTy = llvm::ArrayType::get(Slot.EntryTy, MemoTableSize);
+	auto* Table = new llvm::GlobalVariable(*codeGen.theModule, TableTy, false,
+		llvm::GlobalValue::InternalLinkage, llvm::ConstantAggregateZero::get(TableTy),
+		TheFunction->getName() + ".memo");
+
+	// FNV-1a over whole words.
+	llvm::Value* Hash = llvm::ConstantInt::get(Int64Ty, 14695981039346656037ULL);
+	for (auto &Arg : TheFunction->args()) {
+		llvm::Value* Bits = codeGen.builder->CreateBitCast(&Arg, BitsTy);
+		Bits = codeGen.builder->CreateZExtOrBitCast(Bits, Int64Ty, "bits");
+		Slot.Keys.push_back(Bits);
+		Hash = codeGen.builder->CreateMul(codeGen.builder->CreateXor(Hash, Bits),
+			llvm::ConstantInt::get(Int64Ty, 1099511628211ULL), "hash");
+	}
+	Hash = codeGen.builder->CreateXor(Hash, codeGen.builder->CreateLShr(Hash, 32));
+	llvm::Value* Index = codeGen.builder->CreateAnd(Hash,
+		llvm::ConstantInt::get(Int64Ty, MemoTableSize - 1), "memoidx");
+	Slot.Entry = codeGen.builder->CreateInBoundsGEP(TableTy, Table,
+		{ llvm::ConstantInt::get(Int64Ty, 0), Index }, "memoentry");
+
+	llvm::IRBuilder<>& B = *codeGen.builder;
+	llvm::Value* VersionPtr = B.CreateStructGEP(Slot.EntryTy, Slot.Entry, 0);
+	llvm::LoadInst* Version = B.CreateLoad(Int64Ty, VersionPtr, "memover");
+	Version->setAtomic(llvm::AtomicOrdering::Acquire);
+	Version->setAlignment(8);
+	std::vector<llvm::Value*> Keys;
+	for (unsigned i = 0, e = Slot.Keys.size(); i != e; ++i) {
+		llvm::LoadInst* Key = B.CreateLoad(Int64Ty, B.CreateConstInBoundsGEP2_32(KeysTy,
+			B.CreateStructGEP(Slot.EntryTy, Slot.Entry, 1), 0, i));
+		Key->setAtomic(llvm::AtomicOrdering::Monotonic);
+		Key->setAlignment(8);
+		Keys.push_back(Key);
+	}
+	llvm::LoadInst* Bits = B.CreateLoad(BitsTy, B.CreateStructGEP(Slot.EntryTy, Slot.Entry, 2));
+	Bits->setAtomic(llvm::AtomicOrdering::Monotonic);
+	Bits->setAlignment(BitsTy->getPrimitiveSizeInBits() / 8);
+	// The reads above happen before the version is read again.
+	B.CreateFence(llvm::AtomicOrdering::Acquire);
+	llvm::LoadInst* Recheck = B.CreateLoad(Int64Ty, VersionPtr, "memorecheck");
+	Recheck->setAtomic(llvm::AtomicOrdering::Monotonic);
+	Recheck->setAlignment(8);
+
+	llvm::Value* Stable = B.CreateICmpEQ(B.CreateAnd(Version, 1), B.getInt64(0));
+	llvm::Value* Hit = B.CreateAnd(B.CreateAnd(Stable, B.CreateICmpNE(Version, B.getInt64(0))),
+		B.CreateICmpEQ(Version, Recheck));
+	for (unsigned i = 0, e = Slot.Keys.size(); i != e; ++i)
+		Hit = B.CreateAnd(Hit, B.CreateICmpEQ(Keys[i], Slot.Keys[i]), "memohit");
+
+	llvm::BasicBlock* HitBB = llvm::BasicBlock::Create(*codeGen.theContext, "memohit", TheFunction);
+	llvm::BasicBlock* BodyBB = llvm::BasicBlock::Create(*codeGen.theContext, "body", TheFunction);
+	B.CreateCondBr(Hit, HitBB, BodyBB);
+	B.SetInsertPoint(HitBB);
+	B.CreateRet(B.CreateBitCast(Bits, NumTy));
+	B.SetInsertPoint(BodyBB);
+	return Slot;
+}
+
+/// emitMemoStore - Remember RetVal for the arguments of the slot, unless
+/// another store is writing the entry.  Leaves the builder where the function
+/// returns.
+static void emitMemoStore(llvm::Function* TheFunction, const MemoSlot& Slot, llvm::Value* RetVal,
+	CodeGen& codeGen) {
+	llvm::Type* Int64Ty = llvm::Type::getInt64Ty(*codeGen.theContext);
+	llvm::Type* KeysTy = llvm::ArrayType::get(Int64Ty, Slot.Keys.size());
+	llvm::Type* BitsTy = llvm::Type::getIntNTy(*codeGen.theContext, RetVal->getType()->getPrimitiveSizeInBits());
+	llvm::IRBuilder<>& B = *codeGen.builder;
+	llvm::BasicBlock* WriteBB = llvm::BasicBlock::Create(*codeGen.theContext, "memowrite", TheFunction);
+	llvm::BasicBlock* DoneBB = llvm::BasicBlock::Create(*codeGen.theContext, "memodone", TheFunction);
+
+	// Make the version odd, then write the entry and make it even again.
+	llvm::Value* VersionPtr = B.CreateStructGEP(Slot.EntryTy, Slot.Entry, 0);
+	llvm::LoadInst* Version = B.CreateLoad(Int64Ty, VersionPtr, "memover");
+	Version->setAtomic(llvm::AtomicOrdering::Monotonic);
+	Version->setAlignment(8);
+	llvm::Value* Stable = B.CreateICmpEQ(B.CreateAnd(Version, 1), B.getInt64(0));
+	llvm::BasicBlock* LockBB = llvm::BasicBlock::Create(*codeGen.theContext, "memolock", TheFunction, WriteBB);
+	B.CreateCondBr(Stable, LockBB, DoneBB);
+	B.SetInsertPoint(LockBB);
+	llvm::Value* Locked = B.CreateExtractValue(B.CreateAtomicCmpXchg(VersionPtr, Version,
+		B.CreateAdd(Version, B.getInt64(1)), llvm::AtomicOrdering::Acquire,
+		llvm::AtomicOrdering::Monotonic), 1);
+	B.CreateCondBr(Locked, WriteBB, DoneBB);
+
+	B.SetInsertPoint(WriteBB);
+	for (unsigned i = 0, e = Slot.Keys.size(); i != e; ++i) {
+		llvm::StoreInst* Key = B.CreateStore(Slot.Keys[i], B.CreateConstInBoundsGEP2_32(KeysTy,
+			B.CreateStructGEP(Slot.EntryTy, Slot.Entry, 1), 0, i));
+		Key->setAtomic(llvm::AtomicOrdering::Monotonic);
+		Key->setAlignment(8);
+	}
+	llvm::StoreInst* Bits = B.CreateStore(B.CreateBitCast(RetVal, BitsTy),
+		B.CreateStructGEP(Slot.EntryTy, Slot.Entry, 2));
+	Bits->setAtomic(llvm::AtomicOrdering::Monotonic);
+	Bits->setAlignment(BitsTy->getPrimitiveSizeInBits() / 8);
+	llvm::StoreInst* Unlock = B.CreateStore(B.CreateAdd(Version, B.getInt64(2)), VersionPtr);
+	Unlock->setAtomic(llvm::AtomicOrdering::Release);
+	Unlock->setAlignment(8);
+	B.CreateBr(DoneBB);
+	B.SetInsertPoint(DoneBB);
+}
+
+/// getCounterPtr - The address of a profile counter, compiled in.
+static llvm::Constant* getCounterPtr(uint64_t* Counter, CodeGen& codeGen) {
+	llvm::Type* Int64Ty = llvm::Type::getInt64Ty(*codeGen.theContext);
+	return llvm::ConstantExpr::getIntToPtr(
+		llvm::ConstantInt::get(Int64Ty, reinterpret_cast<uintptr_t>(Counter)),
+		Int64Ty->getPointerTo());
+}
+
+/// isProfiled - Whether the function being generated is counted and given
+/// its loaded counts.  Every top-level expression is named __anon_expr, so
+/// their counts would be mixed up.
+static bool isProfiled(CodeGen& codeGen) {
+	return codeGen.currentProto->getName() != "__anon_expr";
+}
+
+/// emitEntryProfile - Count the calls of the function being generated, and
+/// give it its entry count from the loaded profile.
+static void emitEntryProfile(llvm::Function* TheFunction, CodeGen& codeGen) {
+	if (!isProfiled(codeGen))
+		return;
+	const std::string& Name = codeGen.currentProto->getName();
+	unsigned Site = codeGen.profileSite++;
+	if (!codeGen.option.profileGenerate.empty())
+		codeGen.builder->CreateAtomicRMW(llvm::AtomicRMWInst::Add,
+			getCounterPtr(codeGen.profile.addCounter(Name), codeGen),
+			codeGen.builder->getInt64(1), llvm::AtomicOrdering::Monotonic);
+	int64_t Count = codeGen.profile.getCount(Name, Site);
+	if (Count < 0)
+		return;
+	TheFunction->setEntryCount(Count);
+	// Hot functions are kept together, away from the rest of the code.
+	if (uint64_t(Count) >= codeGen.option.hotThreshold)
+		TheFunction->setSection(codeGen.getCodeSection(true));
+}
+
+/// createProfiledCondBr - Branch to True or False on Cond, counting which way
+/// it goes, and weighted by the loaded profile.
+static llvm::BranchInst* createProfiledCondBr(llvm::Value* Cond, llvm::BasicBlock* True,
+	llvm::BasicBlock* False, CodeGen& codeGen) {
+	if (!isProfiled(codeGen))
+		return codeGen.builder->CreateCondBr(Cond, True, False);
+	const std::string& Name = codeGen.currentProto->getName();
+	unsigned Site = codeGen.profileSite;
+	codeGen.profileSite += 2;
+	if (!codeGen.option.profileGenerate.empty()) {
+		llvm::Constant* TrueCounter = getCounterPtr(codeGen.profile.addCounter(Name), codeGen);
+		llvm::Constant* FalseCounter = getCounterPtr(codeGen.profile.addCounter(Name), codeGen);
+		llvm::Value* Counter = codeGen.builder->CreateSelect(Cond, TrueCounter, FalseCounter, "counter");
+		codeGen.builder->CreateAtomicRMW(llvm::AtomicRMWInst::Add, Counter,
+			codeGen.builder->getInt64(1), llvm::AtomicOrdering::Monotonic);
+	}
+
+	llvm::BranchInst* Br = codeGen.builder->CreateCondBr(Cond, True, False);
+	int64_t TrueCount = codeGen.profile.getCount(Name, Site);
+	int64_t FalseCount = codeGen.profile.getCount(Name, Site + 1);
+	if (TrueCount >= 0 && FalseCount >= 0) {
+		// Weights are 32 bits wide.
+		uint64_t Scale = std::max(TrueCount, FalseCount) / UINT32_MAX + 1;
+		Br->setMetadata(llvm::LLVMContext::MD_prof, llvm::MDBuilder(*codeGen.theContext)
+			.createBranchWeights(uint32_t(TrueCount / Scale), uint32_t(FalseCount / Scale)));
+		codeGen.profiledBranches.push_back(Br);
+	}
+	return Br;
+}
+
+/// dropProfile - Take back the counts given to the function being generated,
+/// when the loaded record turns out to be of another version of it.
+static void dropProfile(llvm::Function* TheFunction, CodeGen& codeGen) {
+	TheFunction->setMetadata(llvm::LLVMContext::MD_prof, nullptr);
+	TheFunction->setSection("");
+	for (llvm::BranchInst* Br : codeGen.profiledBranches)
+		Br->setMetadata(llvm::LLVMContext::MD_prof, nullptr);
+	codeGen.profiledBranches.clear();
+	codeGen.coldRegions.clear();
+}
+
+/// getValueBits - The bits of the number V, zero extended to 64 bits.
+static llvm::Value* getValueBits(llvm::Value* V, llvm::IRBuilder<>& Builder) {
+	llvm::Type* BitsTy = Builder.getIntNTy(V->getType()->getPrimitiveSizeInBits());
+	return Builder.CreateZExt(Builder.CreateBitCast(V, BitsTy), Builder.getInt64Ty());
+}
+
+/// emitValueProfile - Count the values each argument of the function being
+/// generated is called with.  Returns the site of the first value table.
+static unsigned emitValueProfile(llvm::Function* TheFunction, CodeGen& codeGen) {
+	const std::string& Name = codeGen.currentProto->getName();
+	unsigned Site = codeGen.profileSite;
+	if (!isProfiled(codeGen))
+		return Site;
+	codeGen.profileSite += TheFunction->arg_size() * Profile::ValueTableSize;
+	if (codeGen.option.profileGenerate.empty())
+		return Site;
+	llvm::Type* Int64Ty = codeGen.builder->getInt64Ty();
+	llvm::FunctionType* ValueFT = llvm::FunctionType::get(codeGen.builder->getVoidTy(),
+		{ Int64Ty->getPointerTo(), Int64Ty }, false);
+	llvm::Constant* ValueF = codeGen.theModule->getOrInsertFunction("kaleido_profile_value", ValueFT);
+	for (auto& Arg : TheFunction->args())
+		codeGen.builder->CreateCall(ValueF, {
+			getCounterPtr(codeGen.profile.addCounters(Name, Profile::ValueTableSize), codeGen),
+			getValueBits(&Arg, *codeGen.builder) });
+	return Site;
+}
+
+/// SpecializeShare - Percentage of the calls that must pass an argument the
+/// same value for the function to be specialized to it.
+static const uint64_t SpecializeShare = 75;
+
+/// specializeFunction - Give a hot function a clone with the arguments that
+/// nearly always have the same value folded to constants.  A guard in front
+/// of the original body calls the clone when the arguments match, and counts
+/// how often they do.
+static void specializeFunction(llvm::Function* TheFunction, unsigned ValueSite, CodeGen& codeGen) {
+	const std::string& Name = codeGen.currentProto->getName();
+	int64_t Calls = codeGen.profile.getCount(Name, 0);
+	if (Calls < 0 || uint64_t(Calls) < codeGen.option.hotThreshold)
+		return;
+
+	llvm::Type* NumTy = codeGen.getNumTy();
+	const llvm::fltSemantics& Semantics = NumTy->getFltSemantics();
+	unsigned NumBits = NumTy->getPrimitiveSizeInBits();
+	llvm::ValueToValueMapTy VMap;
+	std::vector<std::pair<llvm::Argument*, uint64_t>> Fixed;
+	uint64_t Hits = Calls;
+	std::ostringstream Desc;
+	Desc << Name << '(';
+	unsigned Site = ValueSite;
+	for (auto& Arg : TheFunction->args()) {
+		uint64_t Value, Count, Total;
+		if (codeGen.profile.getTopValue(Name, Site, Value, Count, Total) &&
+			Count * 100 >= Total * SpecializeShare) {
+			llvm::APFloat V(Semantics, llvm::APInt(NumBits, Value));
+			VMap[&Arg] = llvm::ConstantFP::get(*codeGen.theContext, V);
+			Fixed.push_back({ &Arg, Value });
+			Hits = std::min(Hits, Count);
+			if (Fixed.size() > 1)
+				Desc << ", ";
+			Desc << Arg.getName().str() << '=' << (NumBits == 32 ? V.convertToFloat() : V.convertToDouble());
+		}
+		Site += Profile::ValueTableSize;
+	}
+	if (Fixed.empty())
+		return;
+	Desc << ')';
+
+	// The clone drops the fixed arguments.  Only the guard calls it.
+	llvm::Function* SpecF = llvm::CloneFunction(TheFunction, VMap);
+	SpecF->setName(Name + ".spec");
+	OptReport::setSourceFunction(*SpecF, Name);
+	SpecF->setLinkage(llvm::GlobalValue::InternalLinkage);
+	SpecF->setEntryCount(Hits);
+
+	// The guard becomes the entry block, taking the allocas along so they
+	// still dominate all of the original body.
+	llvm::BasicBlock* GenericBB = &TheFunction->getEntryBlock();
+	GenericBB->setName("generic");
+	llvm::BasicBlock* GuardBB = llvm::BasicBlock::Create(*codeGen.theContext, "guard", TheFunction, GenericBB);
+	for (auto I = GenericBB->begin(); I != GenericBB->end();) {
+		llvm::Instruction& Inst = *I++;
+		if (llvm::isa<llvm::AllocaInst>(Inst))
+			Inst.moveBefore(*GuardBB, GuardBB->end());
+	}
+	llvm::BasicBlock* SpecBB = llvm::BasicBlock::Create(*codeGen.theContext, "specialized", TheFunction, GenericBB);
+
+	llvm::IRBuilder<> Builder(GuardBB);
+	llvm::Value* Match = nullptr;
+	for (auto& F : Fixed) {
+		llvm::Value* Eq = Builder.CreateICmpEQ(getValueBits(F.first, Builder), Builder.getInt64(F.second));
+		Match = Match ? Builder.CreateAnd(Match, Eq) : Eq;
+	}
+	codeGen.specializations.emplace_back();
+	Specialization& S = codeGen.specializations.back();
+	S.name = Desc.str();
+	llvm::Value* Counter = Builder.CreateSelect(Match,
+		getCounterPtr(&S.hits, codeGen), getCounterPtr(&S.misses, codeGen), "counter");
+	Builder.CreateAtomicRMW(llvm::AtomicRMWInst::Add, Counter,
+		Builder.getInt64(1), llvm::AtomicOrdering::Monotonic);
+	llvm::BranchInst* Br = Builder.CreateCondBr(Match, SpecBB, GenericBB);
+	uint64_t Scale = uint64_t(Calls) / UINT32_MAX + 1;
+	Br->setMetadata(llvm::LLVMContext::MD_prof, llvm::MDBuilder(*codeGen.theContext)
+		.createBranchWeights(uint32_t(Hits / Scale), uint32_t((Calls - Hits) / Scale)));
+
+	Builder.SetInsertPoint(SpecBB);
+	std::vector<llvm::Value*> Args;
+	for (auto& Arg : TheFunction->args())
+		if (!VMap.count(&Arg))
+			Args.push_back(&Arg);
+	llvm::CallInst* Call = Builder.CreateCall(SpecF, Args);
+	Call->setCallingConv(SpecF->getCallingConv());
+	Call->setTailCall();
+	Builder.CreateRet(Call);
+}
+
+/// ColdBranchRatio - How many times more often the other arm of an if has to
+/// be taken for an arm to be cold.
+static const uint64_t ColdBranchRatio = 100;
+/// ColdBranchMinCount - Executions of an if before its profile is trusted.
+static const uint64_t ColdBranchMinCount = 100;
+
+static bool isColdArm(uint64_t ArmWeight, uint64_t OtherWeight) {
+	return ArmWeight * ColdBranchRatio <= OtherWeight &&
+		ArmWeight + OtherWeight >= ColdBranchMinCount;
+}
+
+/// outlineColdRegions - Move the cold if arms recorded during codegen into
+/// functions of their own in the cold code region, so they do not take room
+/// in the cache lines and pages of the hot code around them.
+static void outlineColdRegions(CodeGen& codeGen) {
+	for (auto& Region : codeGen.coldRegions) {
+		// Part of an arm outlined before.
+		if (Region.entry->getParent() != Region.function)
+			continue;
+
+		std::vector<llvm::BasicBlock*> Blocks;
+		llvm::SmallPtrSet<llvm::BasicBlock*, 8> Seen;
+		std::vector<llvm::BasicBlock*> Worklist = { Region.entry };
+		Seen.insert(Region.merge);
+		while (!Worklist.empty()) {
+			llvm::BasicBlock* BB = Worklist.back();
+			Worklist.pop_back();
+			if (!Seen.insert(BB).second)
+				continue;
+			Blocks.push_back(BB);
+			for (llvm::BasicBlock* Succ : llvm::successors(BB))
+				Worklist.push_back(Succ);
+		}
+
+		llvm::DominatorTree DT(*Region.function);
+		llvm::CodeExtractor Extractor(Blocks, &DT);
+		if (!Extractor.isEligible())
+			continue;
+		if (llvm::Function* ColdF = Extractor.extractCodeRegion()) {
+			ColdF->addFnAttr(llvm::Attribute::Cold);
+			ColdF->addFnAttr(llvm::Attribute::NoInline);
+			if (Region.function->doesNotThrow())
+				ColdF->setDoesNotThrow();
+			ColdF->setSection(codeGen.getCodeSection(false));
+			OptReport::setSourceFunction(*ColdF, OptReport::getSourceFunction(*Region.function));
+		}
+	}
+	codeGen.coldRegions.clear();
+}
+
+/// MathIntrinsics - The libm functions LLVM has intrinsics for.
+static const struct {
+	const char* Name;
+	llvm::Intrinsic::ID ID;
+	unsigned NumArgs;
+} MathIntrinsics[] = {
+	{ "sqrt", llvm::Intrinsic::sqrt, 1 },
+	{ "sin", llvm::Intrinsic::sin, 1 },
+	{ "cos", llvm::Intrinsic::cos, 1 },
+	{ "exp", llvm::Intrinsic::exp, 1 },
+	{ "log", llvm::Intrinsic::log, 1 },
+	{ "fabs", llvm::Intrinsic::fabs, 1 },
+	{ "pow", llvm::Intrinsic::pow, 2 },
+	{ "fma", llvm::Intrinsic::fma, 3 },
+};
+
+/// isMathFunction - Name with NumArgs arguments is one of MathIntrinsics.
+static bool isMathFunction(const std::string& Name, size_t NumArgs) {
+	for (auto& MI : MathIntrinsics)
+		if (Name == MI.Name && NumArgs == MI.NumArgs)
+			return true;
+	return false;
+}
+
+/// getMathIntrinsic - The intrinsic computing the libm function the extern
+/// CalleeF declares, or not_intrinsic.  Only externs with the default double
+/// signature qualify, a 'def sin(x)' stays a call.
+static llvm::Intrinsic::ID getMathIntrinsic(llvm::Function* CalleeF, CodeGen& codeGen) {
+	auto FI = codeGen.functionProtos.find(CalleeF->getName().str());
+	if (FI == codeGen.functionProtos.end() || !FI->second->isExtern())
+		return llvm::Intrinsic::not_intrinsic;
+	llvm::Type* DoubleTy = llvm::Type::getDoubleTy(*codeGen.theContext);
+	if (CalleeF->getReturnType() != DoubleTy)
+		return llvm::Intrinsic::not_intrinsic;
+	for (auto& Arg : CalleeF->args())
+		if (Arg.getType() != DoubleTy)
+			return llvm::Intrinsic::not_intrinsic;
+	for (auto& MI : MathIntrinsics)
+		if (CalleeF->getName() == MI.Name && CalleeF->arg_size() == MI.NumArgs)
+			return MI.ID;
+	return llvm::Intrinsic::not_intrinsic;
+}
+
+/// markTailCall - Mark the call computing V as a tail call when nothing but
+/// Exit follows it.  Exit is the ret of the function or, through the PHIs
+/// joining the arms of ifs, an unconditional branch leading to it.
+static void markTailCall(llvm::Value* V, llvm::Instruction* Exit) {
+	if (auto* CI = llvm::dyn_cast<llvm::CallInst>(V)) {
+		if (CI->getNextNode() == Exit)
+			CI->setTailCall();
+		return;
+	}
+	auto* PN = llvm::dyn_cast<llvm::PHINode>(V);
+	if (!PN || PN->getParent()->getFirstNonPHI() != Exit)
+		return;
+	for (unsigned i = 0, e = PN->getNumIncomingValues(); i != e; ++i) {
+		auto* Br = llvm::dyn_cast<llvm::BranchInst>(PN->getIncomingBlock(i)->getTerminator());
+		if (Br && Br->isUnconditional())
+			markTailCall(PN->getIncomingValue(i), Br);
+	}
+}
+
+/// returnFromArms - Move the ret Exit leads to into the arms of ifs whose
+/// value is a tail call, as the backend only emits a call as a tail call
+/// right before a ret, and at -O0 nothing else duplicates it.  V is the value
+/// Exit passes on.  Merge blocks that lose an arm go to Merged, those that
+/// lose them all to Dead.  Returns true when Exit was replaced by a ret or
+/// its block is dead.
+static bool returnFromArms(llvm::Value* V, llvm::Instruction* Exit,
+	std::vector<llvm::BasicBlock*>& Merged, std::vector<llvm::BasicBlock*>& Dead) {
+	if (auto* CI = llvm::dyn_cast<llvm::CallInst>(V)) {
+		if (!CI->isTailCall() || CI->getNextNode() != Exit || !llvm::isa<llvm::BranchInst>(Exit))
+			return false;
+		llvm::ReturnInst::Create(CI->getContext(), CI, Exit);
+		Exit->eraseFromParent();
+		return true;
+	}
+	auto* PN = llvm::dyn_cast<llvm::PHINode>(V);
+	if (!PN || PN->getParent()->getFirstNonPHI() != Exit)
+		return false;
+	unsigned Arms = PN->getNumIncomingValues();
+	for (unsigned i = Arms; i-- != 0;) {
+		auto* Br = llvm::dyn_cast<llvm::BranchInst>(PN->getIncomingBlock(i)->getTerminator());
+		if (Br && Br->isUnconditional() && returnFromArms(PN->getIncomingValue(i), Br, Merged, Dead))
+			PN->removeIncomingValue(i, false);
+	}
+	if (PN->getNumIncomingValues() == Arms)
+		return false;
+	Merged.push_back(PN->getParent());
+	if (PN->getNumIncomingValues() != 0)
+		return false;
+	Dead.push_back(PN->getParent());
+	return true;
+}
+
+/// inferNoUnwind - Kaleidoscope has no exceptions, so F can only unwind
+/// through a call.  Mark it nounwind when every call is to F itself or to a
+/// function that does not unwind.
+static void inferNoUnwind(llvm::Function* F, PrototypeAST& P) {
+	for (auto& I : llvm::instructions(F))
+		if (auto* CI = llvm::dyn_cast<llvm::CallInst>(&I)) {
+			llvm::Function* Callee = CI->getCalledFunction();
+			if (!Callee || (Callee != F && !Callee->doesNotThrow()))
+				return;
+		}
+	F->setDoesNotThrow();
+	P.setNoUnwind();
+}
+
+/// discardSpawns - Drop the pending joins of a function that failed to generate.
+static void discardSpawns(CodeGen& codeGen) {
+	for (auto& PJ : codeGen.spawnState.pendingJoins) {
+		if (PJ.second != PJ.first)
+			PJ.second->deleteValue();
+		PJ.first->deleteValue();
+	}
+	codeGen.spawnState = SpawnState();
+}
 
 llvm::Value *NumberExprAST::codegen(CodeGen& codeGen) {
-	return llvm::ConstantFP::get(codeGen.theContext, llvm::APFloat(Val));
+	return codeGen.getNum(Val);
 }
 
 llvm::Value * VariableExprAST::codegen(CodeGen& codeGen)
 {
 	// Look this variable up in the function.
-	llvm::Value* V = codeGen.namedValues[Name];
-	if (!V)
-		LogError::LogErrorV("Unknown variable name");
-	return V;
+	auto VI = codeGen.namedValues.find(Name);
+	if (VI != codeGen.namedValues.end() && VI->second)
+		return VI->second;
+	// Otherwise it may name a constant, folded into the code.
+	auto CI = codeGen.constants.find(Name);
+	if (CI != codeGen.constants.end())
+		return codeGen.getNum(CI->second);
+	return LogError::LogErrorV("Unknown variable name");
+}
+
+llvm::Value * UnaryExprAST::codegen(CodeGen & codeGen)
+{
+	llvm::Value *OperandV = Operand->codegen(codeGen);
+	if (!OperandV)
+		return nullptr;
+
+	switch (Opcode) {
+	case '!':
+		// 1.0 for 0.0, 0.0 for everything else.
+		OperandV = codeGen.builder->CreateFCmpOEQ(OperandV, codeGen.getNum(0.0), "nottmp");
+		return codeGen.builder->CreateUIToFP(OperandV, codeGen.getNumTy(), "booltmp");
+	default:
+		return LogError::LogErrorV("invalid unary operator");
+	}
+}
+
+llvm::Value *BinaryExprAST::codegenLogical(CodeGen& codeGen) {
+	llvm::Value *L = LHS->codegen(codeGen);
+	if (!L)
+		return nullptr;
+	bool IsAnd = Op == '&';
+	// 'a && b' is decided by a being 0.0, 'a || b' by a being non zero.
+	llvm::Value *LCond = codeGen.builder->CreateFCmpONE(L, codeGen.getNum(0.0), "lhscond");
+	llvm::Value *Decided = codeGen.getNum(IsAnd ? 0.0 : 1.0);
+
+	// Cheap side effect free operands are evaluated anyway and selected, which
+	// saves a branch.
+	if (RHS->isSpeculatable()) {
+		llvm::Value *R = RHS->codegen(codeGen);
+		if (!R)
+			return nullptr;
+		R = codeGen.builder->CreateUIToFP(
+			codeGen.builder->CreateFCmpONE(R, codeGen.getNum(0.0), "rhscond"),
+			codeGen.getNumTy(), "booltmp");
+		return IsAnd ? codeGen.builder->CreateSelect(LCond, R, Decided, "andtmp")
+			: codeGen.builder->CreateSelect(LCond, Decided, R, "ortmp");
+	}
+
+	llvm::Function *TheFunction = codeGen.builder->GetInsertBlock()->getParent();
+	llvm::BasicBlock *LHSBB = codeGen.builder->GetInsertBlock();
+	llvm::BasicBlock *RHSBB = llvm::BasicBlock::Create(*codeGen.theContext,
+		IsAnd ? "and.rhs" : "or.rhs", TheFunction);
+	llvm::BasicBlock *MergeBB = llvm::BasicBlock::Create(*codeGen.theContext,
+		IsAnd ? "and.end" : "or.end");
+	if (IsAnd)
+		createProfiledCondBr(LCond, RHSBB, MergeBB, codeGen);
+	else
+		createProfiledCondBr(LCond, MergeBB, RHSBB, codeGen);
+
+	codeGen.builder->SetInsertPoint(RHSBB);
+	llvm::Value *R = RHS->codegen(codeGen);
+	if (!R)
+		return nullptr;
+	R = codeGen.builder->CreateUIToFP(
+		codeGen.builder->CreateFCmpONE(R, codeGen.getNum(0.0), "rhscond"),
+		codeGen.getNumTy(), "booltmp");
+	codeGen.builder->CreateBr(MergeBB);
+	// Codegen of RHS can change the current block, update RHSBB for the PHI.
+	RHSBB = codeGen.builder->GetInsertBlock();
+
+	TheFunction->getBasicBlockList().push_back(MergeBB);
+	codeGen.builder->SetInsertPoint(MergeBB);
+	llvm::PHINode *PN = codeGen.builder->CreatePHI(codeGen.getNumTy(), 2,
+		IsAnd ? "andtmp" : "ortmp");
+	PN->addIncoming(Decided, LHSBB);
+	PN->addIncoming(R, RHSBB);
+	return PN;
 }
 
 llvm::Value *BinaryExprAST::codegen(CodeGen& codeGen) {
+	if (Op == '&' || Op == '|')
+		return codegenLogical(codeGen);
+
 	llvm::Value *L = LHS->codegen(codeGen);
 	llvm::Value *R = RHS->codegen(codeGen);
 	if (!L || !R)
 		return nullptr;
 	switch (Op) {
 	case '+':
-		return codeGen.builder.CreateFAdd(L, R, "addtmp");
+		return codeGen.builder->CreateFAdd(L, R, "addtmp");
 	case '-':
-		return codeGen.builder.CreateFSub(L, R, "subtmp");
+		return codeGen.builder->CreateFSub(L, R, "subtmp");
 	case '*':
-		return codeGen.builder.CreateFMul(L, R, "multmp");
+		return codeGen.builder->CreateFMul(L, R, "multmp");
 	case '<':
-		L = codeGen.builder.CreateFCmpULT(L, R, "cmptmp");
-		// Convert bool 0/1 to double 0.0 or 1.0
-		return codeGen.builder.CreateUIToFP(L, llvm::Type::getDoubleTy(codeGen.theContext),
-			"booltmp");
+		L = codeGen.builder->CreateFCmpULT(L, R, "cmptmp");
+		// Convert bool 0/1 to 0.0 or 1.0
+		return codeGen.builder->CreateUIToFP(L, codeGen.getNumTy(), "booltmp");
 	default:
 		return LogError::LogErrorV("invalid binary operator");
 	}
@@ -44,7 +879,176 @@ llvm::Value *BinaryExprAST::codegen(CodeGen& codeGen) {
 
 }
 
+ExprAST* BinaryExprAST::getLoopBound(const std::string& Var, const CodeGen& codeGen) const {
+	auto* LHSVar = dynamic_cast<VariableExprAST*>(LHS.get());
+	if (Op != '<' || !LHSVar || LHSVar->getName() != Var)
+		return nullptr;
+	// Kaleidoscope variables never change, so only Var itself varies.
+	if (!RHS->isSideEffectFree(codeGen) || RHS->usesVariable(Var))
+		return nullptr;
+	return RHS.get();
+}
+
+bool ParallelForExprAST::isSideEffectFree(const CodeGen & codeGen) const
+{
+	return Start->isSideEffectFree(codeGen) && End->isSideEffectFree(codeGen) &&
+		(!Step || Step->isSideEffectFree(codeGen)) && Body->isSideEffectFree(codeGen);
+}
+
+unsigned ParallelForExprAST::estimateCost(const CodeGen & codeGen) const
+{
+	unsigned Bounds = Start->estimateCost(codeGen) + End->estimateCost(codeGen) +
+		(Step ? Step->estimateCost(codeGen) : 0);
+	return loopCost(Bounds, Body->estimateCost(codeGen) + 4);
+}
+
+llvm::Value * ParallelForExprAST::codegen(CodeGen & codeGen)
+{
+	// Start, end and step are evaluated once, before any iteration runs.
+	llvm::Value *StartVal = Start->codegen(codeGen);
+	if (!StartVal)
+		return nullptr;
+	llvm::Value *EndVal = End->codegen(codeGen);
+	if (!EndVal)
+		return nullptr;
+	llvm::Value *StepVal = codeGen.getNum(1.0);
+	if (Step) {
+		StepVal = Step->codegen(codeGen);
+		if (!StepVal)
+			return nullptr;
+	}
+
+	llvm::Type* NumTy = codeGen.getNumTy();
+	llvm::Type* Int64Ty = llvm::Type::getInt64Ty(*codeGen.theContext);
+	llvm::Type* BytePtrTy = llvm::Type::getInt8PtrTy(*codeGen.theContext);
+
+	// A sequential for runs the body and then tests 'Var < End', so run as many
+	// iterations as it would.
+	llvm::Value* TripCount = emitTripCount(StartVal, EndVal, StepVal, codeGen);
+
+	// The environment passed to the body holds start, step and every variable
+	// visible here.
+	std::vector<std::string> Captures;
+	for (auto &NV : codeGen.namedValues)
+		if (NV.first != VarName && NV.second)
+			Captures.push_back(NV.first);
+	llvm::Type* EnvTy = llvm::ArrayType::get(NumTy, Captures.size() + 2);
+	llvm::AllocaInst* Env = codeGen.createEntryBlockAlloca(EnvTy, "env");
+	auto envSlot = [&](llvm::Value* EnvPtr, unsigned Idx) {
+		return codeGen.builder->CreateConstInBoundsGEP2_32(EnvTy, EnvPtr, 0, Idx);
+	};
+	codeGen.builder->CreateStore(StartVal, envSlot(Env, 0));
+	codeGen.builder->CreateStore(StepVal, envSlot(Env, 1));
+	for (unsigned i = 0, e = Captures.size(); i != e; ++i)
+		codeGen.builder->CreateStore(codeGen.namedValues[Captures[i]], envSlot(Env, i + 2));
+
+	// Outline the body into: void body(i64 Begin, i64 End, i8* Env)
+	llvm::FunctionType* BodyFT = llvm::FunctionType::get(llvm::Type::getVoidTy(*codeGen.theContext),
+		{ Int64Ty, Int64Ty, BytePtrTy }, false);
+	llvm::Function* BodyF = llvm::Function::Create(BodyFT, llvm::Function::InternalLinkage,
+		codeGen.currentProto->getName() + ".pfor", codeGen.theModule.get());
+	OptReport::setSourceFunction(*BodyF, codeGen.currentProto->getName());
+	auto ArgIt = BodyF->arg_begin();
+	llvm::Value* BeginArg = &*ArgIt++;
+	llvm::Value* EndArg = &*ArgIt++;
+	llvm::Value* EnvArg = &*ArgIt;
+
+	llvm::BasicBlock* SavedBB = codeGen.builder->GetInsertBlock();
+	auto SavedNamedValues = codeGen.namedValues;
+	SpawnState SavedSpawnState = std::move(codeGen.spawnState);
+	codeGen.spawnState = SpawnState();
+
+	llvm::BasicBlock* EntryBB = llvm::BasicBlock::Create(*codeGen.theContext, "entry", BodyF);
+	codeGen.builder->SetInsertPoint(EntryBB);
+	llvm::Value* BodyEnv = codeGen.builder->CreateBitCast(EnvArg, EnvTy->getPointerTo(), "env");
+	llvm::Value* BodyStart = codeGen.builder->CreateLoad(NumTy, envSlot(BodyEnv, 0), "start");
+	llvm::Value* BodyStep = codeGen.builder->CreateLoad(NumTy, envSlot(BodyEnv, 1), "step");
+	codeGen.namedValues.clear();
+	for (unsigned i = 0, e = Captures.size(); i != e; ++i)
+		codeGen.namedValues[Captures[i]] =
+			codeGen.builder->CreateLoad(NumTy, envSlot(BodyEnv, i + 2), Captures[i]);
+
+	// The runtime never hands out an empty chunk, so the loop is bottom tested.
+	llvm::BasicBlock* LoopBB = llvm::BasicBlock::Create(*codeGen.theContext, "loop", BodyF);
+	codeGen.builder->CreateBr(LoopBB);
+	codeGen.builder->SetInsertPoint(LoopBB);
+	llvm::PHINode* Index = codeGen.builder->CreatePHI(Int64Ty, 2, "index");
+	Index->addIncoming(BeginArg, EntryBB);
+	codeGen.namedValues[VarName] = codeGen.builder->CreateFAdd(BodyStart,
+		codeGen.builder->CreateFMul(codeGen.builder->CreateSIToFP(Index, NumTy), BodyStep),
+		VarName);
+
+	if (!Body->codegen(codeGen)) {
+		discardSpawns(codeGen);
+		BodyF->eraseFromParent();
+		codeGen.namedValues = SavedNamedValues;
+		codeGen.spawnState = std::move(SavedSpawnState);
+		codeGen.builder->SetInsertPoint(SavedBB);
+		return nullptr;
+	}
+
+	llvm::Value* NextIndex = codeGen.builder->CreateAdd(
+		Index, llvm::ConstantInt::get(Int64Ty, 1), "nextindex");
+	llvm::BasicBlock* LoopEndBB = codeGen.builder->GetInsertBlock();
+	llvm::BasicBlock* AfterBB = llvm::BasicBlock::Create(*codeGen.theContext, "afterloop", BodyF);
+	createProfiledCondBr(codeGen.builder->CreateICmpSLT(NextIndex, EndArg, "loopcond"),
+		LoopBB, AfterBB, codeGen);
+	Index->addIncoming(NextIndex, LoopEndBB);
+	codeGen.builder->SetInsertPoint(AfterBB);
+	finishSpawns(BodyF, codeGen.builder->CreateRetVoid(), codeGen);
+
+	llvm::verifyFunction(*BodyF);
+
+	// Back in the enclosing function, hand the iterations to the runtime.
+	codeGen.namedValues = SavedNamedValues;
+	codeGen.spawnState = std::move(SavedSpawnState);
+	codeGen.builder->SetInsertPoint(SavedBB);
+	llvm::FunctionType* RunFT = llvm::FunctionType::get(llvm::Type::getVoidTy(*codeGen.theContext),
+		{ BodyFT->getPointerTo(), Int64Ty, BytePtrTy }, false);
+	llvm::Constant* RunF = codeGen.theModule->getOrInsertFunction("kaleido_parallel_for", RunFT);
+	codeGen.builder->CreateCall(RunF,
+		{ BodyF, TripCount, codeGen.builder->CreateBitCast(Env, BytePtrTy) });
+
+	// parallel for expr always returns 0.0, like for.
+	return llvm::Constant::getNullValue(NumTy);
+}
+
+bool CallExprAST::isSideEffectFree(const CodeGen & codeGen) const
+{
+	auto FI = codeGen.functionProtos.find(Callee);
+	if (FI == codeGen.functionProtos.end() || !FI->second->isPure())
+		return false;
+	for (auto& Arg : Args)
+		if (!Arg->isSideEffectFree(codeGen))
+			return false;
+	return true;
+}
+
+unsigned CallExprAST::estimateCost(const CodeGen & codeGen) const
+{
+	uint64_t Cost = 5 + Args.size();
+	for (auto& Arg : Args)
+		Cost += Arg->estimateCost(codeGen);
+	auto FI = codeGen.functionProtos.find(Callee);
+	if (FI != codeGen.functionProtos.end())
+		Cost += FI->second->isExtern() ? ExternCallCost : FI->second->getCost();
+	return std::min<uint64_t>(MaxCost, Cost);
+}
+
+bool CallExprAST::isParallelCandidate(const CodeGen & codeGen) const
+{
+	// Memo tables are not safe to fill from several threads.
+	if (IsSpawn || codeGen.option.memoize)
+		return false;
+	return isSideEffectFree(codeGen) &&
+		estimateCost(codeGen) >= codeGen.option.parallelArgThreshold;
+}
+
 llvm::Value *CallExprAST::codegen(CodeGen& codeGen) {
+	return codegenCall(codeGen, IsSpawn);
+}
+
+llvm::Value *CallExprAST::codegenCall(CodeGen& codeGen, bool Spawn) {
 	// Look up the name in the global module table.
 	llvm::Function *CalleeF = getFunction(Callee,codeGen);
 	if (!CalleeF)
@@ -54,22 +1058,108 @@ llvm::Value *CallExprAST::codegen(CodeGen& codeGen) {
 	if (CalleeF->arg_size() != Args.size())
 		return LogError::LogErrorV("Incorrect # arguments passed");
 
+	// A pure function may only call pure functions.
+	if (codeGen.currentProto && codeGen.currentProto->isPure()) {
+		auto FI = codeGen.functionProtos.find(Callee);
+		if (FI == codeGen.functionProtos.end() || !FI->second->isPure())
+			return LogError::LogErrorV("pure function calls impure function");
+	}
+
+	// Expensive arguments that are independent of each other are started as
+	// tasks, except the last one which this thread evaluates meanwhile.  Their
+	// joins end up right before this call.
+	std::vector<bool> SpawnArg(Args.size(), false);
+	if (codeGen.option.parallelArgs && Args.size() > 1) {
+		int Last = -1;
+		for (unsigned i = 0, e = Args.size(); i != e; ++i) {
+			auto* ArgCall = dynamic_cast<CallExprAST*>(Args[i].get());
+			if (ArgCall && ArgCall->isParallelCandidate(codeGen)) {
+				SpawnArg[i] = true;
+				Last = i;
+			}
+		}
+		if (Last >= 0)
+			SpawnArg[Last] = false;
+	}
+
 	std::vector<llvm::Value *> ArgsV;
 	for (unsigned i = 0, e = Args.size(); i != e; ++i) {
-		ArgsV.push_back(Args[i]->codegen(codeGen));
+		if (SpawnArg[i])
+			ArgsV.push_back(static_cast<CallExprAST&>(*Args[i]).codegenCall(codeGen, true));
+		else
+			ArgsV.push_back(Args[i]->codegen(codeGen));
 		if (!ArgsV.back())
 			return nullptr;
 	}
 
-	return codeGen.builder.CreateCall(CalleeF, ArgsV, "calltmp");
+	if (Spawn)
+		return spawnCall(CalleeF, ArgsV, codeGen);
+
+	// Math externs become intrinsics, which LLVM folds, hoists and vectorizes.
+	// They take the numeric type, so no conversion is needed.
+	if (llvm::Intrinsic::ID IID = getMathIntrinsic(CalleeF, codeGen)) {
+		llvm::Function* IntrinsicF = llvm::Intrinsic::getDeclaration(
+			codeGen.theModule.get(), IID, { codeGen.getNumTy() });
+		return codeGen.builder->CreateCall(IntrinsicF, ArgsV, "calltmp");
+	}
+
+	// Externs take their C types, e.g. double even when the numeric type is float.
+	for (unsigned i = 0, e = ArgsV.size(); i != e; ++i)
+		ArgsV[i] = codeGen.convertNum(ArgsV[i], CalleeF->getFunctionType()->getParamType(i));
+
+	if (CalleeF->getReturnType()->isVoidTy()) {
+		// void externs evaluate to 0.0.
+		codeGen.builder->CreateCall(CalleeF, ArgsV);
+		return codeGen.getNum(0.0);
+	}
+	llvm::CallInst* CallV = codeGen.builder->CreateCall(CalleeF, ArgsV, "calltmp");
+	CallV->setCallingConv(CalleeF->getCallingConv());
+	return codeGen.convertNum(CallV, codeGen.getNumTy());
+}
+
+/// declareForeign - Decide whether the function P declares is foreign, with
+/// its C signature and convention, or Kaleidoscope code, with the numeric
+/// type and fastcc.  Only facts the compiler owns decide, never what the host
+/// happens to export: typed externs and externs of runtime, library or libm
+/// functions are foreign, any other name is that of a definition, even while
+/// only an untyped extern declares it, e.g. for mutual recursion.  The first
+/// declaration of a name decides and an untyped extern follows it, so every
+/// caller agrees with the body.  Returns false, with an error, when P
+/// contradicts it.
+static bool declareForeign(const PrototypeAST& P, CodeGen& codeGen, bool& Foreign) {
+	const std::string& Name = P.getName();
+	auto FI = codeGen.foreignFunctions.find(Name);
+	Foreign = P.isExtern() && (P.isTyped() || codeGen.libraryFunctions.count(Name) ||
+		isMathFunction(Name, P.getNumArgs()));
+	if (FI == codeGen.foreignFunctions.end()) {
+		codeGen.foreignFunctions[Name] = Foreign;
+		return true;
+	}
+	if (P.isExtern() && !P.isTyped())
+		Foreign = FI->second;
+	if (Foreign == FI->second)
+		return true;
+	LogError::LogErrorBase(Foreign ? "Function is Kaleidoscope code, its extern can not be foreign"
+		: "Function is foreign, it can not be defined");
+	return false;
 }
 
 llvm::Function *PrototypeAST::codegen(CodeGen& codeGen) {
+	// Top-level expressions are called from the host.
+	bool Foreign;
+	if (!declareForeign(*this, codeGen, Foreign))
+		return nullptr;
+
 	// Make the function type:  double(double,double) etc.
-	std::vector<llvm::Type*> Doubles(Args.size(),
-		llvm::Type::getDoubleTy(codeGen.theContext));
+	llvm::Type* RetTy = codeGen.getNumTy();
+	std::vector<llvm::Type*> ArgTys(Args.size(), RetTy);
+	if (Foreign) {
+		RetTy = codeGen.getValueType(RetType);
+		for (unsigned i = 0, e = Args.size(); i != e; ++i)
+			ArgTys[i] = codeGen.getValueType(ArgTypes[i]);
+	}
 	llvm::FunctionType *FT =
-		llvm::FunctionType::get(llvm::Type::getDoubleTy(codeGen.theContext), Doubles, false);
+		llvm::FunctionType::get(RetTy, ArgTys, false);
 
 	llvm::Function *F =
 		llvm::Function::Create(FT, llvm::Function::ExternalLinkage, Name, codeGen.theModule.get());
@@ -78,35 +1168,119 @@ llvm::Function *PrototypeAST::codegen(CodeGen& codeGen) {
 	for (auto &Arg : F->args())
 		Arg.setName(Args[Idx++]);
 
+	if (!Foreign && Name != "__anon_expr")
+		F->setCallingConv(llvm::CallingConv::Fast);
+	if (IsNoUnwind)
+		F->addFnAttr(llvm::Attribute::NoUnwind);
+
+	// Calls to pure functions can be combined, hoisted or dropped.
+	if (IsPure) {
+		F->addFnAttr(llvm::Attribute::ReadNone);
+		F->addFnAttr(llvm::Attribute::NoUnwind);
+	}
+
 	return F;
 }
 
 llvm::Function *FunctionAST::codegen(CodeGen& codeGen) {
 	// Transfer ownership of the prototype to the FunctionProtos map, but keep a
 	// reference to it for use below.
+	// Only possible when the whole program shares one module.  The recorded
+	// prototype stays that of the first definition.
+	llvm::Function* Existing = codeGen.theModule->getFunction(Proto->getName());
+	if (Existing && !Existing->empty()) {
+		LogError::LogErrorBase("Function cannot be redefined");
+		return nullptr;
+	}
+	bool Foreign;
+	if (!declareForeign(*Proto, codeGen, Foreign))
+		return nullptr;
 	auto &P = *Proto;
 	codeGen.functionProtos[Proto->getName()] = std::move(Proto);
 	llvm::Function* TheFunction = getFunction(P.getName(),codeGen);
 	if (!TheFunction)
 		return nullptr;
 	// Create a new basic block to start insertion into.
-	llvm::BasicBlock *BB = llvm::BasicBlock::Create(codeGen.theContext, "entry", TheFunction);
-	codeGen.builder.SetInsertPoint(BB);
+	llvm::BasicBlock *BB = llvm::BasicBlock::Create(*codeGen.theContext, "entry", TheFunction);
+	codeGen.builder->SetInsertPoint(BB);
 
 	// Record the function arguments in the NamedValues map.
 	codeGen.namedValues.clear();
 	for (auto &Arg : TheFunction->args())
 		codeGen.namedValues[Arg.getName()] = &Arg;
+	codeGen.spawnState = SpawnState();
+	codeGen.currentProto = &P;
+	codeGen.builder->setFastMathFlags(codeGen.getFastMathFlags(P));
+	codeGen.profileSite = 0;
+	codeGen.profiledBranches.clear();
+	codeGen.coldRegions.clear();
+	if (!codeGen.option.profileGenerate.empty() && isProfiled(codeGen))
+		codeGen.profile.beginFunction(P.getName());
+	emitEntryProfile(TheFunction, codeGen);
+	unsigned ValueSite = emitValueProfile(TheFunction, codeGen);
+	// The counters are written to, even by pure functions.
+	if (!codeGen.option.profileGenerate.empty())
+		TheFunction->removeFnAttr(llvm::Attribute::ReadNone);
+	// A call to the function being defined is priced like a loop of unknown
+	// trip count over one level of its body, in which such calls are free.
+	P.setCost(0);
+	P.setCost(loopCost(0, Body->estimateCost(codeGen)));
+	P.setCost(Body->estimateCost(codeGen));
+
+	// Pure functions may remember their results.  The definition then writes
+	// to its table, so only declarations in other modules keep readnone.
+	bool Memoize = P.isPure() && codeGen.option.memoize && TheFunction->arg_size() > 0;
+	MemoSlot Memo;
+	if (Memoize) {
+		TheFunction->removeFnAttr(llvm::Attribute::ReadNone);
+		Memo = emitMemoLookup(TheFunction, codeGen);
+		codeGen.spawnState.bodyBB = codeGen.builder->GetInsertBlock();
+	}
+
 	if (llvm::Value *RetVal = Body->codegen(codeGen)) {
+		if (Memoize)
+			emitMemoStore(TheFunction, Memo, RetVal, codeGen);
 		// Finish off the function.
-		codeGen.builder.CreateRet(RetVal);
+		llvm::ReturnInst* Ret = codeGen.builder->CreateRet(RetVal);
+		finishSpawns(TheFunction, Ret, codeGen);
+		// Calls in tail position, including those in the arms of ifs, need
+		// no stack frame of their own; TailCallElim turns self recursion
+		// into loops.
+		markTailCall(RetVal, Ret);
+		if (codeGen.option.guaranteedTailCalls) {
+			std::vector<llvm::BasicBlock*> Merged, Dead;
+			returnFromArms(RetVal, Ret, Merged, Dead);
+			// Arms that return are no longer regions ending at their merge.
+			codeGen.coldRegions.erase(std::remove_if(codeGen.coldRegions.begin(),
+				codeGen.coldRegions.end(), [&](const ColdRegion& Region) {
+					return llvm::is_contained(Merged, Region.merge);
+				}), codeGen.coldRegions.end());
+			for (llvm::BasicBlock* BB : Dead)
+				BB->dropAllReferences();
+			for (llvm::BasicBlock* BB : Dead)
+				BB->eraseFromParent();
+		}
+		inferNoUnwind(TheFunction, P);
+		// A record with another number of sites is of another version.
+		bool ProfileFits = codeGen.profile.fits(P.getName(), codeGen.profileSite);
+		if (!ProfileFits)
+			dropProfile(TheFunction, codeGen);
+		// Top-level expressions run once, their cold code would only be moved.
+		if (P.getName() != "__anon_expr")
+			outlineColdRegions(codeGen);
+		if (codeGen.option.specialize && ProfileFits && isProfiled(codeGen))
+			specializeFunction(TheFunction, ValueSite, codeGen);
 
 		// Validate the generated code, checking for consistency.
 		llvm::verifyFunction(*TheFunction);
-		codeGen.theFPM->run(*TheFunction);
+		// The whole program is optimized at once, at the end.
+		if (!codeGen.option.wholeProgram)
+			codeGen.optimizeModule(P.getName());
 		return TheFunction;
 	}
 	// Error reading body, remove function.
+	discardSpawns(codeGen);
+	codeGen.coldRegions.clear();
 	TheFunction->eraseFromParent();
 	return nullptr;
 }
@@ -134,73 +1308,94 @@ llvm::Value * IfExprAST::codegen(CodeGen & codeGen)
 		return nullptr;
 
 	// Convert condition to a bool by comparing non-equal to 0.0.
-	CondV = codeGen.builder.CreateFCmpONE(
-		CondV, llvm::ConstantFP::get(codeGen.theContext, llvm::APFloat(0.0)), "ifcond");
-	llvm::Function *TheFunction = codeGen.builder.GetInsertBlock()->getParent();
+	CondV = codeGen.builder->CreateFCmpONE(
+		CondV, codeGen.getNum(0.0), "ifcond");
+	llvm::Function *TheFunction = codeGen.builder->GetInsertBlock()->getParent();
 
 	// Create blocks for the then and else cases.  Insert the 'then' block at the
 	// end of the function.
 	llvm::BasicBlock *ThenBB =
-		llvm::BasicBlock::Create(codeGen.theContext, "then", TheFunction);
-	llvm::BasicBlock *ElseBB = llvm::BasicBlock::Create(codeGen.theContext, "else");
-	llvm::BasicBlock *MergeBB = llvm::BasicBlock::Create(codeGen.theContext, "ifcont");
+		llvm::BasicBlock::Create(*codeGen.theContext, "then", TheFunction);
+	llvm::BasicBlock *ElseBB = llvm::BasicBlock::Create(*codeGen.theContext, "else");
+	llvm::BasicBlock *MergeBB = llvm::BasicBlock::Create(*codeGen.theContext, "ifcont");
 
-	codeGen.builder.CreateCondBr(CondV, ThenBB, ElseBB);
+	llvm::BranchInst* Br = createProfiledCondBr(CondV, ThenBB, ElseBB, codeGen);
+	uint64_t ThenWeight, ElseWeight;
+	if (Br->extractProfMetadata(ThenWeight, ElseWeight)) {
+		if (isColdArm(ThenWeight, ElseWeight))
+			codeGen.coldRegions.push_back({ TheFunction, ThenBB, MergeBB });
+		if (isColdArm(ElseWeight, ThenWeight))
+			codeGen.coldRegions.push_back({ TheFunction, ElseBB, MergeBB });
+	}
 	// Emit then value.
-	codeGen.builder.SetInsertPoint(ThenBB);
+	codeGen.builder->SetInsertPoint(ThenBB);
 
 	llvm::Value *ThenV = Then->codegen(codeGen);
 	if (!ThenV)
 		return nullptr;
 
-	codeGen.builder.CreateBr(MergeBB);
+	codeGen.builder->CreateBr(MergeBB);
 	// Codegen of 'Then' can change the current block, update ThenBB for the PHI.
-	ThenBB = codeGen.builder.GetInsertBlock();
+	ThenBB = codeGen.builder->GetInsertBlock();
 	// Emit else block.
 	TheFunction->getBasicBlockList().push_back(ElseBB);
-	codeGen.builder.SetInsertPoint(ElseBB);
+	codeGen.builder->SetInsertPoint(ElseBB);
 
 	llvm::Value *ElseV = Else->codegen(codeGen);
 	if (!ElseV)
 		return nullptr;
 
-	codeGen.builder.CreateBr(MergeBB);
+	codeGen.builder->CreateBr(MergeBB);
 	// codegen of 'Else' can change the current block, update ElseBB for the PHI.
-	ElseBB = codeGen.builder.GetInsertBlock();
+	ElseBB = codeGen.builder->GetInsertBlock();
 	// Emit merge block.
 	TheFunction->getBasicBlockList().push_back(MergeBB);
-	codeGen.builder.SetInsertPoint(MergeBB);
+	codeGen.builder->SetInsertPoint(MergeBB);
 	llvm::PHINode *PN =
-		codeGen.builder.CreatePHI(llvm::Type::getDoubleTy(codeGen.theContext), 2, "iftmp");
+		codeGen.builder->CreatePHI(codeGen.getNumTy(), 2, "iftmp");
 
 	PN->addIncoming(ThenV, ThenBB);
 	PN->addIncoming(ElseV, ElseBB);
 	return PN;
 }
 
+bool ForExprAST::isSideEffectFree(const CodeGen & codeGen) const
+{
+	return Start->isSideEffectFree(codeGen) && End->isSideEffectFree(codeGen) &&
+		(!Step || Step->isSideEffectFree(codeGen)) && Body->isSideEffectFree(codeGen);
+}
+
+unsigned ForExprAST::estimateCost(const CodeGen & codeGen) const
+{
+	unsigned Bounds = Start->estimateCost(codeGen) + End->estimateCost(codeGen) +
+		(Step ? Step->estimateCost(codeGen) : 0);
+	return loopCost(Bounds, Body->estimateCost(codeGen) + 4);
+}
+
 llvm::Value * ForExprAST::codegen(CodeGen & codeGen)
 {
 	// Emit the start code first, without 'variable' in scope.
 	llvm::Value *StartVal = Start->codegen(codeGen);
 	if (!StartVal)
 		return nullptr;
+	LoopInduction Induction(VarName, End.get(), Step.get());
+	if (!Induction.emitPreheader(StartVal, codeGen))
+		return nullptr;
 
 	// Make the new basic block for the loop header, inserting after current
 	// block.
-	llvm::Function *TheFunction = codeGen.builder.GetInsertBlock()->getParent();
-	llvm::BasicBlock *PreheaderBB = codeGen.builder.GetInsertBlock();
-	llvm::BasicBlock *LoopBB = llvm::BasicBlock::Create(codeGen.theContext, "loop", TheFunction);
+	llvm::Function *TheFunction = codeGen.builder->GetInsertBlock()->getParent();
+	llvm::BasicBlock *PreheaderBB = codeGen.builder->GetInsertBlock();
+	llvm::BasicBlock *LoopBB = llvm::BasicBlock::Create(*codeGen.theContext, "loop", TheFunction);
 
 	// Insert an explicit fall through from the current block to the LoopBB.
-	codeGen.builder.CreateBr(LoopBB);
+	codeGen.builder->CreateBr(LoopBB);
 
 	// Start insertion in LoopBB.
-	codeGen.builder.SetInsertPoint(LoopBB);
+	codeGen.builder->SetInsertPoint(LoopBB);
 
 	// Start the PHI node with an entry for Start.
-	llvm::PHINode *Variable =
-		codeGen.builder.CreatePHI(llvm::Type::getDoubleTy(codeGen.theContext), 2, VarName);
-	Variable->addIncoming(StartVal, PreheaderBB);
+	llvm::Value *Variable = Induction.emitVariable(PreheaderBB, codeGen);
 
 	// Within the loop, the variable is defined equal to the PHI node.  If it
 	// shadows an existing variable, we have to restore it, so save it now.
@@ -213,42 +1408,24 @@ llvm::Value * ForExprAST::codegen(CodeGen & codeGen)
 	if (!Body->codegen(codeGen))
 		return nullptr;
 
-	// Emit the step value.
-	llvm::Value *StepVal = nullptr;
-	if (Step) {
-		StepVal = Step->codegen(codeGen);
-		if (!StepVal)
-			return nullptr;
-	}
-	else {
-		// If not specified, use 1.0.
-		StepVal = llvm::ConstantFP::get(codeGen.theContext, llvm::APFloat(1.0));
-	}
-
-	llvm::Value *NextVar = codeGen.builder.CreateFAdd(Variable, StepVal, "nextvar");
-
-	// Compute the end condition.
-	llvm::Value *EndCond = End->codegen(codeGen);
+	// Step the variable and compute the end condition.
+	llvm::Value *EndCond = Induction.emitCondition(codeGen);
 	if (!EndCond)
 		return nullptr;
 
-	// Convert condition to a bool by comparing non-equal to 0.0.
-	EndCond = codeGen.builder.CreateFCmpONE(
-		EndCond, llvm:: ConstantFP::get(codeGen.theContext, llvm::APFloat(0.0)), "loopcond");
-
 	// Create the "after loop" block and insert it.
-	llvm::BasicBlock *LoopEndBB = codeGen.builder.GetInsertBlock();
+	llvm::BasicBlock *LoopEndBB = codeGen.builder->GetInsertBlock();
 	llvm::BasicBlock *AfterBB =
-		llvm::BasicBlock::Create(codeGen.theContext, "afterloop", TheFunction);
+		llvm::BasicBlock::Create(*codeGen.theContext, "afterloop", TheFunction);
 
 	// Insert the conditional branch into the end of LoopEndBB.
-	codeGen.builder.CreateCondBr(EndCond, LoopBB, AfterBB);
+	createProfiledCondBr(EndCond, LoopBB, AfterBB, codeGen);
 
 	// Any new code will be inserted in AfterBB.
-	codeGen.builder.SetInsertPoint(AfterBB);
+	codeGen.builder->SetInsertPoint(AfterBB);
 
 	// Add a new entry to the PHI node for the backedge.
-	Variable->addIncoming(NextVar, LoopEndBB);
+	Induction.addBackedge(LoopEndBB);
 
 	// Restore the unshadowed variable.
 	if (OldVal)
@@ -257,5 +1434,124 @@ llvm::Value * ForExprAST::codegen(CodeGen & codeGen)
 		codeGen.namedValues.erase(VarName);
 
 	// for expr always returns 0.0.
-	return llvm::Constant::getNullValue(llvm::Type::getDoubleTy(codeGen.theContext));
+	return llvm::Constant::getNullValue(codeGen.getNumTy());
+}
+
+bool ReductionExprAST::isSideEffectFree(const CodeGen & codeGen) const
+{
+	return Start->isSideEffectFree(codeGen) && End->isSideEffectFree(codeGen) &&
+		(!Step || Step->isSideEffectFree(codeGen)) && Body->isSideEffectFree(codeGen);
+}
+
+unsigned ReductionExprAST::estimateCost(const CodeGen & codeGen) const
+{
+	unsigned Bounds = Start->estimateCost(codeGen) + End->estimateCost(codeGen) +
+		(Step ? Step->estimateCost(codeGen) : 0);
+	return loopCost(Bounds, Body->estimateCost(codeGen) + 4);
+}
+
+llvm::Value * ReductionExprAST::codegen(CodeGen & codeGen)
+{
+	// Emit the start code first, without 'variable' in scope.
+	llvm::Value *StartVal = Start->codegen(codeGen);
+	if (!StartVal)
+		return nullptr;
+	LoopInduction Induction(VarName, End.get(), Step.get());
+	if (!Induction.emitPreheader(StartVal, codeGen))
+		return nullptr;
+
+	// The loop is the one of for/in, plus an accumulator carried around it.
+	llvm::Function *TheFunction = codeGen.builder->GetInsertBlock()->getParent();
+	llvm::BasicBlock *PreheaderBB = codeGen.builder->GetInsertBlock();
+	llvm::BasicBlock *LoopBB = llvm::BasicBlock::Create(*codeGen.theContext, "loop", TheFunction);
+	codeGen.builder->CreateBr(LoopBB);
+	codeGen.builder->SetInsertPoint(LoopBB);
+
+	llvm::Value *Variable = Induction.emitVariable(PreheaderBB, codeGen);
+
+	// Start the accumulator with the identity of the reduction.
+	double Identity = 0.0;
+	switch (Reduction) {
+	case Sum: Identity = 0.0; break;
+	case Product: Identity = 1.0; break;
+	case Min: Identity = HUGE_VAL; break;
+	case Max: Identity = -HUGE_VAL; break;
+	}
+	llvm::PHINode *Acc = codeGen.builder->CreatePHI(codeGen.getNumTy(), 2, "acc");
+	Acc->addIncoming(codeGen.getNum(Identity), PreheaderBB);
+
+	llvm::Value *OldVal = codeGen.namedValues[VarName];
+	codeGen.namedValues[VarName] = Variable;
+
+	llvm::Value *BodyVal = Body->codegen(codeGen);
+	if (!BodyVal)
+		return nullptr;
+
+	// Floating point math is not associative, so the combining operation may
+	// only be reordered (and vectorized) when asked to.
+	llvm::Value *NextAcc = nullptr;
+	{
+		llvm::IRBuilder<>::FastMathFlagGuard FMFGuard(*codeGen.builder);
+		if (codeGen.option.reassocReductions) {
+			llvm::FastMathFlags FMF = codeGen.builder->getFastMathFlags();
+			FMF.setAllowReassoc();
+			codeGen.builder->setFastMathFlags(FMF);
+		}
+		switch (Reduction) {
+		case Sum:
+			NextAcc = codeGen.builder->CreateFAdd(Acc, BodyVal, "nextacc");
+			break;
+		case Product:
+			NextAcc = codeGen.builder->CreateFMul(Acc, BodyVal, "nextacc");
+			break;
+		case Min:
+			// Compare and select is the min/max pattern the vectorizer recognizes.
+			// NaN body values never compare less or greater, so they are skipped.
+			NextAcc = codeGen.builder->CreateSelect(
+				codeGen.builder->CreateFCmpOLT(BodyVal, Acc), BodyVal, Acc, "nextacc");
+			break;
+		case Max:
+			NextAcc = codeGen.builder->CreateSelect(
+				codeGen.builder->CreateFCmpOGT(BodyVal, Acc), BodyVal, Acc, "nextacc");
+			break;
+		}
+	}
+
+	llvm::Value *EndCond = Induction.emitCondition(codeGen);
+	if (!EndCond)
+		return nullptr;
+
+	llvm::BasicBlock *LoopEndBB = codeGen.builder->GetInsertBlock();
+	llvm::BasicBlock *AfterBB =
+		llvm::BasicBlock::Create(*codeGen.theContext, "afterloop", TheFunction);
+	createProfiledCondBr(EndCond, LoopBB, AfterBB, codeGen);
+	codeGen.builder->SetInsertPoint(AfterBB);
+
+	Induction.addBackedge(LoopEndBB);
+	Acc->addIncoming(NextAcc, LoopEndBB);
+
+	// Restore the unshadowed variable.
+	if (OldVal)
+		codeGen.namedValues[VarName] = OldVal;
+	else
+		codeGen.namedValues.erase(VarName);
+
+	return NextAcc;
+}
+
+llvm::Value * SyncExprAST::codegen(CodeGen & codeGen)
+{
+	// A variable or constant named sync hides the expression.
+	if (codeGen.namedValues.count("sync") || codeGen.constants.count("sync"))
+		return VariableExprAST("sync").codegen(codeGen);
+	// Nothing was spawned yet if there is no frame, so there is nothing to wait for.
+	if (llvm::Value* Frame = codeGen.spawnState.frame) {
+		llvm::FunctionType* SyncFT = llvm::FunctionType::get(llvm::Type::getVoidTy(*codeGen.theContext),
+			{ llvm::Type::getInt8PtrTy(*codeGen.theContext) }, false);
+		llvm::Constant* SyncF = codeGen.theModule->getOrInsertFunction("kaleido_sync", SyncFT);
+		codeGen.builder->CreateCall(SyncF, { Frame });
+	}
+
+	// sync expr always returns 0.0.
+	return llvm::Constant::getNullValue(codeGen.getNumTy());
 }
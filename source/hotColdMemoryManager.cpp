@@ -0,0 +1,131 @@
+#include "hotColdMemoryManager.hpp"
+#include "llvm/Support/Process.h"
+#include <algorithm>
+#include <iterator>
+
+/// SlabSize - Bytes the arenas map at a time.
+static const uintptr_t SlabSize = 1 << 20;
+
+const char* getHotSection(bool MachO)
+{
+	return MachO ? "__TEXT,__text_hot" : ".text.hot";
+}
+
+const char* getColdSection(bool MachO)
+{
+	return MachO ? "__TEXT,__text_cold" : ".text.cold";
+}
+
+CodeArena::~CodeArena()
+{
+	for (auto& Slab : slabs)
+		llvm::sys::Memory::releaseMappedMemory(Slab);
+}
+
+bool CodeArena::isSlabStart(const uint8_t* P) const
+{
+	return std::any_of(slabs.begin(), slabs.end(),
+		[P](const llvm::sys::MemoryBlock& Slab) { return Slab.base() == P; });
+}
+
+llvm::sys::MemoryBlock CodeArena::allocate(uintptr_t Size, unsigned Alignment)
+{
+	// Chunks are whole pages, so protecting one never touches another.
+	uintptr_t PageSize = llvm::sys::Process::getPageSize();
+	uintptr_t Align = std::max<uintptr_t>(PageSize, Alignment);
+	Size = llvm::alignTo(std::max<uintptr_t>(Size, 1), PageSize);
+	for (int Attempt = 0; Attempt != 2; ++Attempt) {
+		for (auto FI = freeRanges.begin(); FI != freeRanges.end(); ++FI) {
+			uint8_t* Start = FI->first;
+			uint8_t* End = Start + FI->second;
+			uint8_t* Base = reinterpret_cast<uint8_t*>(llvm::alignTo(uintptr_t(Start), Align));
+			if (Base > End || uintptr_t(End - Base) < Size)
+				continue;
+			freeRanges.erase(FI);
+			if (Base != Start)
+				freeRanges[Start] = Base - Start;
+			if (Base + Size != End)
+				freeRanges[Base + Size] = End - (Base + Size);
+			// Pages given back were left executable.
+			llvm::sys::MemoryBlock Chunk(Base, Size);
+			if (llvm::sys::Memory::protectMappedMemory(Chunk,
+				llvm::sys::Memory::MF_READ | llvm::sys::Memory::MF_WRITE)) {
+				release(Chunk);
+				return llvm::sys::MemoryBlock();
+			}
+			return Chunk;
+		}
+		// Map the next slab right after the last one when the system allows.
+		std::error_code EC;
+		llvm::sys::MemoryBlock Near;
+		if (!slabs.empty())
+			Near = slabs.back();
+		llvm::sys::MemoryBlock Slab = llvm::sys::Memory::allocateMappedMemory(
+			std::max(Size + Align, SlabSize), &Near,
+			llvm::sys::Memory::MF_READ | llvm::sys::Memory::MF_WRITE, EC);
+		if (EC)
+			return llvm::sys::MemoryBlock();
+		slabs.push_back(Slab);
+		freeRanges[static_cast<uint8_t*>(Slab.base())] = Slab.size();
+	}
+	return llvm::sys::MemoryBlock();
+}
+
+void CodeArena::release(llvm::sys::MemoryBlock Chunk)
+{
+	uint8_t* Start = static_cast<uint8_t*>(Chunk.base());
+	uintptr_t Size = Chunk.size();
+	auto Next = freeRanges.lower_bound(Start);
+	if (Next != freeRanges.end() && Next->first == Start + Size && !isSlabStart(Next->first)) {
+		Size += Next->second;
+		Next = freeRanges.erase(Next);
+	}
+	if (Next != freeRanges.begin() && !isSlabStart(Start)) {
+		auto Prev = std::prev(Next);
+		if (Prev->first + Prev->second == Start) {
+			Prev->second += Size;
+			return;
+		}
+	}
+	freeRanges[Start] = Size;
+}
+
+uint8_t* HotColdMemoryManager::allocateCodeSection(uintptr_t Size, unsigned Alignment,
+	unsigned SectionID, llvm::StringRef SectionName)
+{
+	CodeArena* Arena = nullptr;
+	if (SectionName == ".text.hot" || SectionName == "__text_hot")
+		Arena = hot.get();
+	else if (SectionName == ".text.cold" || SectionName == "__text_cold")
+		Arena = cold.get();
+	if (Arena) {
+		llvm::sys::MemoryBlock Chunk = Arena->allocate(Size, Alignment);
+		if (Chunk.base()) {
+			chunks.push_back({ Arena, Chunk });
+			pending.push_back(Chunk);
+			return static_cast<uint8_t*>(Chunk.base());
+		}
+	}
+	return SectionMemoryManager::allocateCodeSection(Size, Alignment, SectionID, SectionName);
+}
+
+HotColdMemoryManager::~HotColdMemoryManager()
+{
+	for (auto& Chunk : chunks)
+		Chunk.first->release(Chunk.second);
+}
+
+bool HotColdMemoryManager::finalizeMemory(std::string* ErrMsg)
+{
+	for (auto& Chunk : pending) {
+		if (std::error_code EC = llvm::sys::Memory::protectMappedMemory(Chunk,
+			llvm::sys::Memory::MF_READ | llvm::sys::Memory::MF_EXEC)) {
+			if (ErrMsg)
+				*ErrMsg = EC.message();
+			return true;
+		}
+		llvm::sys::Memory::InvalidateInstructionCache(Chunk.base(), Chunk.size());
+	}
+	pending.clear();
+	return SectionMemoryManager::finalizeMemory(ErrMsg);
+}
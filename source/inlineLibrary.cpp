@@ -0,0 +1,152 @@
+#include "inlineLibrary.hpp"
+#include "llvm/Bitcode/BitcodeReader.h"
+#include "llvm/Bitcode/BitcodeWriter.h"
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/InstIterator.h"
+#include "llvm/Transforms/Utils/Cloning.h"
+#include "llvm/Transforms/Utils/ValueMapper.h"
+
+/// isModuleLocal - True when V is, or is built from, a global that a copy of
+/// the function in another module could not refer to.
+static bool isModuleLocal(const llvm::Value* V) {
+	if (auto* GV = llvm::dyn_cast<llvm::GlobalValue>(V))
+		return llvm::isa<llvm::GlobalVariable>(GV) || GV->hasLocalLinkage();
+	if (auto* C = llvm::dyn_cast<llvm::Constant>(V))
+		for (const llvm::Use& Op : C->operands())
+			if (isModuleLocal(Op.get()))
+				return true;
+	return false;
+}
+
+/// getInlineSize - Instructions of F, 0 when it refers to something only its
+/// own module has.
+static unsigned getInlineSize(const llvm::Function& F) {
+	unsigned Size = 0;
+	for (auto& I : llvm::instructions(F)) {
+		for (const llvm::Use& Op : I.operands())
+			if (isModuleLocal(Op.get()))
+				return 0;
+		++Size;
+	}
+	return Size;
+}
+
+/// copyToContext - A copy of M in Context, made through bitcode since IR can
+/// not refer to another context.
+static std::unique_ptr<llvm::Module> copyToContext(const llvm::Module& M, llvm::LLVMContext& Context) {
+	llvm::SmallVector<char, 0> Buffer;
+	llvm::raw_svector_ostream OS(Buffer);
+	llvm::WriteBitcodeToFile(&M, OS);
+	llvm::MemoryBufferRef Bitcode(llvm::StringRef(Buffer.data(), Buffer.size()), M.getModuleIdentifier());
+	return llvm::cantFail(llvm::parseBitcodeFile(Bitcode, Context));
+}
+
+std::set<std::string> InlineLibrary::importInto(llvm::Module& M, unsigned Budget) const
+{
+	std::set<std::string> Imported;
+	std::vector<llvm::Function*> Worklist;
+	for (auto& F : M)
+		if (F.isDeclaration() && !F.isIntrinsic())
+			Worklist.push_back(&F);
+
+	while (!Worklist.empty()) {
+		llvm::Function* Decl = Worklist.back();
+		Worklist.pop_back();
+		auto EI = entries.find(Decl->getName().str());
+		if (EI == entries.end() || !EI->second.size || EI->second.size > Budget)
+			continue;
+		const llvm::Function* Def = EI->second.optimized->getFunction(Decl->getName());
+		// A redefinition may have changed the signature since M was generated.
+		if (!Decl->isDeclaration() || Def->getFunctionType() != Decl->getFunctionType())
+			continue;
+
+		llvm::ValueToValueMapTy VMap;
+		auto DeclArg = Decl->arg_begin();
+		for (auto& Arg : Def->args()) {
+			DeclArg->setName(Arg.getName());
+			VMap[&Arg] = &*DeclArg++;
+		}
+		// The functions the body calls are declared in M, and may be imported too.
+		for (auto& I : llvm::instructions(Def))
+			for (const llvm::Use& Op : I.operands()) {
+				auto* Callee = llvm::dyn_cast<llvm::Function>(Op.get());
+				if (!Callee || VMap.count(Callee))
+					continue;
+				llvm::Function* MF = M.getFunction(Callee->getName());
+				if (!MF) {
+					MF = llvm::Function::Create(Callee->getFunctionType(),
+						llvm::Function::ExternalLinkage, Callee->getName(), &M);
+					MF->copyAttributesFrom(Callee);
+					if (!MF->isIntrinsic())
+						Worklist.push_back(MF);
+				}
+				VMap[Callee] = MF;
+			}
+
+		llvm::SmallVector<llvm::ReturnInst*, 4> Returns;
+		// ModuleLevelChanges, the body moves to another module.
+		llvm::CloneFunctionInto(Decl, Def, VMap, true, Returns);
+		Decl->setLinkage(llvm::GlobalValue::AvailableExternallyLinkage);
+		Imported.insert(Decl->getName().str());
+	}
+	return Imported;
+}
+
+void InlineLibrary::add(const std::string& Name, std::unique_ptr<llvm::Module> Source,
+	const llvm::Module& Optimized, std::set<std::string> Imports)
+{
+	Entry& E = entries[Name];
+	E.source = std::move(Source);
+	E.optimized = llvm::CloneModule(Optimized);
+	E.imports = std::move(Imports);
+	E.size = 0;
+
+	const llvm::Function* F = E.optimized->getFunction(Name);
+	if (!F || F->isDeclaration() || F->hasLocalLinkage())
+		return;
+	E.size = getInlineSize(*F);
+}
+
+void InlineLibrary::addLibrary(const llvm::Module& Library)
+{
+	for (auto& F : Library) {
+		if (F.isDeclaration() || F.hasLocalLinkage())
+			continue;
+		Entry& E = entries[F.getName().str()];
+		E.source.reset();
+		E.imports.clear();
+		// Its own module holds F, the rest of the library is declared.  The
+		// size is taken in the library, where references to its internal
+		// functions are still seen as such.
+		llvm::ValueToValueMapTy VMap;
+		E.optimized = llvm::CloneModule(Library, VMap,
+			[&](const llvm::GlobalValue* GV) { return GV == &F; });
+		E.size = getInlineSize(F);
+	}
+}
+
+std::vector<std::string> InlineLibrary::getDependents(const std::string& Name) const
+{
+	std::vector<std::string> Dependents;
+	for (auto& E : entries)
+		if (E.second.imports.count(Name))
+			Dependents.push_back(E.first);
+	return Dependents;
+}
+
+std::unique_ptr<llvm::Module> InlineLibrary::cloneSource(const std::string& Name) const
+{
+	auto EI = entries.find(Name);
+	if (EI == entries.end())
+		return nullptr;
+	return llvm::CloneModule(*EI->second.source);
+}
+
+void InlineLibrary::moveToContext(llvm::LLVMContext& Context)
+{
+	for (auto& E : entries) {
+		if (E.second.source)
+			E.second.source = copyToContext(*E.second.source, Context);
+		E.second.optimized = copyToContext(*E.second.optimized, Context);
+	}
+}
@@ -41,6 +41,14 @@ TokenResult gettok() {
 		tr.token = tok_number;
 		return tr;
 	}
+	if (LastChar == '"') { // String: "[^"\n]*", its text in identifierStr.
+		while ((LastChar = getchar()) != '"' && LastChar != EOF && LastChar != '\n')
+			tr.identifierStr += LastChar;
+		if (LastChar == '"')
+			LastChar = getchar();
+		tr.token = tok_string;
+		return tr;
+	}
 	if (LastChar == '#') {
 		// Comment until end of line.
 		do
@@ -56,6 +64,18 @@ TokenResult gettok() {
 		return tr;
 	}
 
+	// '&&' and '||'.  A single '&' or '|' is an unknown character.
+	if (LastChar == '&' || LastChar == '|') {
+		tr.thisChar = LastChar;
+		tr.token = tok_none;
+		LastChar = getchar();
+		if (LastChar == tr.thisChar) {
+			tr.token = tr.thisChar == '&' ? tok_and : tok_or;
+			LastChar = getchar();
+		}
+		return tr;
+	}
+
 	// Otherwise, just return the character as its ascii value.
 	tr.thisChar = LastChar;
 	tr.token = tok_none;
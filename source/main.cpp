@@ -1,11 +1,10 @@
 #include <iostream>
 #include "parser.hpp"
-#include "externFunc.hpp"
-void main()
+int main(int argc, char* argv[])
 {
 
     std::cout << "hello" << std::endl;
-	auto codeGen = std::make_unique<CodeGen>();
+	auto codeGen = std::make_unique<CodeGen>(parseOption(argc, argv));
 	Parser parser(std::move(codeGen));
 	parser.Do();
 }
\ No newline at end of file
@@ -0,0 +1,148 @@
+#include "optReport.hpp"
+#include "llvm/Support/Format.h"
+
+/// getInstructionCount - Instructions in the body of F.
+static unsigned getInstructionCount(const llvm::Function& F) {
+	unsigned Count = 0;
+	for (auto& BB : F)
+		Count += BB.size();
+	return Count;
+}
+
+/// isReported - F is generated for a source function of this module, not
+/// imported for inlining.
+static bool isReported(const llvm::Function& F) {
+	return !F.isDeclaration() && !F.hasAvailableExternallyLinkage();
+}
+
+/// writeJSONString - S quoted and escaped as a JSON string.
+static void writeJSONString(llvm::raw_ostream& OS, llvm::StringRef S) {
+	OS << '"';
+	for (char C : S) {
+		if (C == '"' || C == '\\')
+			OS << '\\' << C;
+		else if (C == '\n')
+			OS << "\\n";
+		else if (static_cast<unsigned char>(C) < 0x20)
+			OS << llvm::format("\\u%04x", C);
+		else
+			OS << C;
+	}
+	OS << '"';
+}
+
+/// SourceAttr - Function attribute naming the source function a generated
+/// function belongs to.
+static const char SourceAttr[] = "kaleido-source";
+
+void OptReport::setSourceFunction(llvm::Function& F, llvm::StringRef Owner)
+{
+	F.addFnAttr(SourceAttr, Owner);
+}
+
+std::string OptReport::getSourceFunction(const llvm::Function& F)
+{
+	if (F.hasFnAttribute(SourceAttr))
+		return F.getFnAttribute(SourceAttr).getValueAsString().str();
+	return F.getName().str();
+}
+
+void OptReport::addRemark(const llvm::DiagnosticInfoIROptimization& R)
+{
+	Remark Entry;
+	Entry.kind = R.isPassed() ? "passed" : R.isMissed() ? "missed" : "analysis";
+	Entry.pass = R.getPassName().str();
+	Entry.name = R.getRemarkName().str();
+	Entry.function = R.getFunction().getName().str();
+	Entry.message = R.getMsg();
+	remarks[getSourceFunction(R.getFunction())].push_back(std::move(Entry));
+}
+
+void OptReport::countBefore(const llvm::Module& M)
+{
+	// A function optimized again replaces what was reported for it.
+	for (auto& F : M)
+		if (isReported(F)) {
+			std::string Source = getSourceFunction(F);
+			remarks.erase(Source);
+			counts.erase(Source);
+		}
+	for (auto& F : M)
+		if (isReported(F))
+			counts[getSourceFunction(F)][F.getName().str()].before = getInstructionCount(F);
+}
+
+void OptReport::countAfter(const llvm::Module& M)
+{
+	for (auto& F : M)
+		if (isReported(F))
+			counts[getSourceFunction(F)][F.getName().str()].after = getInstructionCount(F);
+}
+
+void OptReport::printText(llvm::raw_ostream& OS) const
+{
+	for (auto& S : counts) {
+		OS << S.first << ":\n";
+		// A body has at least one instruction, none left means it was deleted.
+		for (auto& F : S.second)
+			if (F.second.after)
+				OS << "  " << F.first << ": " << F.second.before << " -> "
+					<< F.second.after << " instructions\n";
+			else
+				OS << "  " << F.first << ": " << F.second.before << " instructions, removed\n";
+		auto RI = remarks.find(S.first);
+		if (RI == remarks.end())
+			continue;
+		for (auto& R : RI->second)
+			OS << "  " << R.kind << ' ' << R.pass << '/' << R.name << " in "
+				<< R.function << ": " << R.message << '\n';
+	}
+}
+
+void OptReport::printJSON(llvm::raw_ostream& OS) const
+{
+	OS << "[\n";
+	bool FirstSource = true;
+	for (auto& S : counts) {
+		OS << (FirstSource ? "" : ",\n") << "  {\"function\": ";
+		FirstSource = false;
+		writeJSONString(OS, S.first);
+		OS << ", \"instructions\": [";
+		bool First = true;
+		for (auto& F : S.second) {
+			OS << (First ? "" : ", ") << "{\"name\": ";
+			First = false;
+			writeJSONString(OS, F.first);
+			OS << ", \"before\": " << F.second.before << ", \"after\": " << F.second.after << '}';
+		}
+		OS << "], \"remarks\": [";
+		First = true;
+		auto RI = remarks.find(S.first);
+		if (RI != remarks.end())
+			for (auto& R : RI->second) {
+				OS << (First ? "" : ",") << "\n    {\"kind\": \"" << R.kind << "\", \"pass\": ";
+				First = false;
+				writeJSONString(OS, R.pass);
+				OS << ", \"name\": ";
+				writeJSONString(OS, R.name);
+				OS << ", \"in\": ";
+				writeJSONString(OS, R.function);
+				OS << ", \"message\": ";
+				writeJSONString(OS, R.message);
+				OS << '}';
+			}
+		OS << "]}";
+	}
+	OS << "\n]\n";
+}
+
+bool OptReportHandler::handleDiagnostics(const llvm::DiagnosticInfo& DI)
+{
+	if (auto* R = llvm::dyn_cast<llvm::DiagnosticInfoIROptimization>(&DI)) {
+		report.addRemark(*R);
+		return true;
+	}
+	// Remarks of the code generator are dropped, everything else is printed
+	// as usual.
+	return llvm::isa<llvm::DiagnosticInfoOptimizationBase>(&DI);
+}
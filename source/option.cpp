@@ -0,0 +1,100 @@
+#include "option.hpp"
+#include "logError.hpp"
+#include <string>
+#include <cstdlib>
+
+/// parseFastMath - The FastMathFlag bits of a list like "reassoc,contract".
+static unsigned parseFastMath(const std::string& List)
+{
+	unsigned Flags = 0;
+	size_t Pos = 0;
+	while (Pos <= List.size()) {
+		size_t End = List.find(',', Pos);
+		if (End == std::string::npos)
+			End = List.size();
+		std::string Flag = List.substr(Pos, End - Pos);
+		if (Flag == "reassoc")
+			Flags |= FastMathReassoc;
+		else if (Flag == "contract")
+			Flags |= FastMathContract;
+		else if (Flag == "nnan")
+			Flags |= FastMathNoNaNs;
+		else if (Flag == "ninf")
+			Flags |= FastMathNoInfs;
+		else if (Flag == "nsz")
+			Flags |= FastMathNoSignedZeros;
+		else
+			LogError::LogErrorBase(("unknown fast-math flag " + Flag).c_str());
+		Pos = End + 1;
+	}
+	return Flags;
+}
+
+Option parseOption(int argc, char * argv[])
+{
+	Option option;
+	for (int i = 1; i < argc; ++i) {
+		std::string arg = argv[i];
+		if (arg == "-float")
+			option.useFloat = true;
+		else if (arg == "-reassoc-reductions")
+			option.reassocReductions = true;
+		else if (arg == "-memo")
+			option.memoize = true;
+		else if (arg == "-parallel-args")
+			option.parallelArgs = true;
+		else if (arg.compare(0, 15, "-parallel-args=") == 0) {
+			option.parallelArgs = true;
+			option.parallelArgThreshold = std::strtoul(arg.c_str() + 15, nullptr, 10);
+		}
+		else if (arg == "-O0" || arg == "-O1" || arg == "-O2" || arg == "-O3") {
+			option.optLevel = arg[2] - '0';
+			option.optSize = false;
+		}
+		else if (arg == "-Os") {
+			option.optLevel = 2;
+			option.optSize = true;
+		}
+		else if (arg.compare(0, 15, "-inline-budget=") == 0)
+			option.inlineBudget = std::strtoul(arg.c_str() + 15, nullptr, 10);
+		else if (arg == "-whole-program")
+			option.wholeProgram = true;
+		else if (arg == "-tco")
+			option.guaranteedTailCalls = true;
+		else if (arg.compare(0, 8, "-veclib=") == 0) {
+			option.vecLib = arg.substr(8);
+			if (option.vecLib != "SVML" && option.vecLib != "Accelerate" && option.vecLib != "none")
+				LogError::LogErrorBase(("unknown vector library " + option.vecLib).c_str());
+		}
+		else if (arg.compare(0, 18, "-profile-generate=") == 0)
+			option.profileGenerate = arg.substr(18);
+		else if (arg.compare(0, 13, "-profile-use=") == 0)
+			option.profileUse = arg.substr(13);
+		else if (arg.compare(0, 15, "-hot-threshold=") == 0)
+			option.hotThreshold = std::strtoul(arg.c_str() + 15, nullptr, 10);
+		else if (arg == "-specialize")
+			option.specialize = true;
+		else if (arg.compare(0, 6, "-mcpu=") == 0)
+			option.cpu = arg.substr(6);
+		else if (arg.compare(0, 7, "-mattr=") == 0)
+			option.cpuFeatures = arg.substr(7);
+		else if (arg == "-opt-report")
+			option.optReport = "text";
+		else if (arg.compare(0, 12, "-opt-report=") == 0) {
+			option.optReport = arg.substr(12);
+			if (option.optReport != "text" && option.optReport != "json")
+				LogError::LogErrorBase(("unknown report format " + option.optReport).c_str());
+		}
+		else if (arg.compare(0, 17, "-recycle-context=") == 0)
+			option.recycleContext = std::strtoul(arg.c_str() + 17, nullptr, 10);
+		else if (arg.compare(0, 6, "--lib=") == 0)
+			option.libs.push_back(arg.substr(6));
+		else if (arg == "-ffast-math")
+			option.fastMath = FastMathAll;
+		else if (arg.compare(0, 12, "-ffast-math=") == 0)
+			option.fastMath = parseFastMath(arg.substr(12));
+		else
+			LogError::LogErrorBase(("unknown option " + arg).c_str());
+	}
+	return option;
+}
@@ -35,6 +35,32 @@ std::unique_ptr<ExprAST> Parser::ParseIdentifierExpr() {
 	std::string IdName = curTok.identifierStr;
 
 	getNextToken();  // eat identifier.
+	return ParseIdentifierExpr(IdName);
+}
+
+std::unique_ptr<ExprAST> Parser::ParseIdentifierExpr(const std::string& IdName) {
+	// 'parallel' before 'for' and 'sync' when not called start expressions of
+	// their own, other uses of the words are names.
+	if (IdName == "parallel" && curTok.token == tok_for)
+		return ParseParallelForExpr();
+	if (IdName == "sync" && curTok.thisChar != '(')
+		return ParseSyncExpr();
+
+	// A reduction name followed by the loop variable, like 'sum i = ...', and
+	// 'spawn' followed by the callee.  Two identifiers in a row mean nothing
+	// else, so these names stay usable for variables and functions.
+	if (curTok.token == tok_identifier) {
+		if (IdName == "spawn")
+			return ParseSpawnExpr();
+		if (IdName == "sum")
+			return ParseReductionExpr(ReductionExprAST::Sum);
+		if (IdName == "product")
+			return ParseReductionExpr(ReductionExprAST::Product);
+		if (IdName == "min")
+			return ParseReductionExpr(ReductionExprAST::Min);
+		if (IdName == "max")
+			return ParseReductionExpr(ReductionExprAST::Max);
+	}
 
 	if (curTok.thisChar != '(') // Simple variable ref.
 		return std::make_unique<VariableExprAST>(IdName);
@@ -68,6 +94,7 @@ std::unique_ptr<ExprAST> Parser::ParseIdentifierExpr() {
 ///   ::= identifierexpr
 ///   ::= numberexpr
 ///   ::= parenexpr
+///   ::= unaryexpr
 std::unique_ptr<ExprAST> Parser::ParsePrimary() {
 	switch (curTok.token) {
 	default:
@@ -83,14 +110,28 @@ std::unique_ptr<ExprAST> Parser::ParsePrimary() {
 	case tok_none:
 		if (curTok.thisChar == '(')
 			return ParseParenExpr();
+		if (curTok.thisChar == '!')
+			return ParseUnaryExpr();
 		return LogError::LogError("unknown token when expecting an expression");
 	}
 }
 
+/// unaryexpr ::= '!' primary
+std::unique_ptr<ExprAST> Parser::ParseUnaryExpr() {
+	int Opc = curTok.thisChar;
+	getNextToken();  // eat the operator.
+	if (auto Operand = ParsePrimary())
+		return std::make_unique<UnaryExprAST>(Opc, std::move(Operand));
+	return nullptr;
+}
+
 /// GetTokPrecedence - Get the precedence of the pending binary operator token.
 int Parser::GetTokPrecedence() {
 	if (!isascii(curTok.thisChar))
 		return -1;
+	// Only the doubled '&&' and '||' are operators.
+	if ((curTok.thisChar == '&' || curTok.thisChar == '|') && curTok.token == tok_none)
+		return -1;
 
 	// Make sure it's a declared binop.
 	int TokPrec = binopPrecedence[curTok.thisChar];
@@ -143,28 +184,103 @@ std::unique_ptr<ExprAST> Parser::ParseBinOpRHS(int ExprPrec,std::unique_ptr<Expr
 }
 
 /// prototype
-///   ::= id '(' id* ')'
-std::unique_ptr<PrototypeAST> Parser::ParsePrototype() {
+///   ::= qualifier* id '(' (id (':' type)?)* ')' (':' type)?
+/// qualifier ::= 'pure' | 'fast'
+std::unique_ptr<PrototypeAST> Parser::ParsePrototype(bool IsExtern) {
 	if (curTok.token != tok_identifier)
 		return LogError::LogErrorP("Expected function name in prototype");
 
 	std::string FnName = curTok.identifierStr;
 	getNextToken();
 
+	// Qualifiers are the identifiers before the one followed by '(', so they
+	// are still usable as function names.
+	bool IsPure = false;
+	bool IsFast = false;
+	while (curTok.token == tok_identifier) {
+		if (FnName == "pure")
+			IsPure = true;
+		else if (FnName == "fast")
+			IsFast = true;
+		else
+			return LogError::LogErrorP("Unknown qualifier in prototype");
+		FnName = curTok.identifierStr;
+		getNextToken();
+	}
+
 	if (curTok.thisChar != '(')
 		return LogError::LogErrorP("Expected '(' in prototype");
 
-	// Read the list of argument names.
+	// Read the list of argument names, each with an optional type.
 	std::vector<std::string> ArgNames;
-	while (getNextToken().token == tok_identifier)
+	std::vector<ValueType> ArgTypes;
+	bool IsTyped = false;
+	getNextToken();  // eat '('.
+	while (curTok.token == tok_identifier) {
 		ArgNames.push_back(curTok.identifierStr);
+		ValueType Ty = ValueType::Double;
+		if (getNextToken().thisChar == ':') {
+			if (!ParseType(Ty))
+				return nullptr;
+			if (Ty == ValueType::Void)
+				return LogError::LogErrorP("Argument can not be void");
+			IsTyped = true;
+		}
+		ArgTypes.push_back(Ty);
+	}
 	if (curTok.thisChar != ')')
 		return LogError::LogErrorP("Expected ')' in prototype");
 
 	// success.
 	getNextToken();  // eat ')'.
 
-	return std::make_unique<PrototypeAST>(FnName, std::move(ArgNames));
+	ValueType RetType = ValueType::Double;
+	if (curTok.thisChar == ':') {
+		if (!ParseType(RetType))
+			return nullptr;
+		IsTyped = true;
+	}
+	if (IsTyped && !IsExtern)
+		return LogError::LogErrorP("Only externs can have types");
+
+	auto Proto = std::make_unique<PrototypeAST>(FnName, std::move(ArgNames), IsExtern);
+	Proto->setTypes(std::move(ArgTypes), RetType);
+	if (IsTyped)
+		Proto->setTyped();
+	if (IsPure)
+		Proto->setPure();
+	if (IsFast)
+		Proto->setFast();
+	return Proto;
+}
+
+/// type ::= 'double' | 'float' | 'i32' | 'i64' | 'ptr' | 'void'
+bool Parser::ParseType(ValueType& Ty) {
+	getNextToken();  // eat ':'.
+	if (curTok.token != tok_identifier) {
+		LogError::LogErrorBase("Expected type after ':'");
+		return false;
+	}
+
+	const std::string& Name = curTok.identifierStr;
+	if (Name == "double")
+		Ty = ValueType::Double;
+	else if (Name == "float")
+		Ty = ValueType::Float;
+	else if (Name == "i32")
+		Ty = ValueType::I32;
+	else if (Name == "i64")
+		Ty = ValueType::I64;
+	else if (Name == "ptr")
+		Ty = ValueType::Ptr;
+	else if (Name == "void")
+		Ty = ValueType::Void;
+	else {
+		LogError::LogErrorBase("Unknown type");
+		return false;
+	}
+	getNextToken();  // eat type.
+	return true;
 }
 
 /// definition ::= 'def' prototype expression
@@ -181,12 +297,13 @@ std::unique_ptr<FunctionAST> Parser::ParseDefinition() {
 /// external ::= 'extern' prototype
 std::unique_ptr<PrototypeAST> Parser::ParseExtern() {
 	getNextToken();  // eat extern.
-	return ParsePrototype();
+	return ParsePrototype(true);
 }
 
 /// toplevelexpr ::= expression
-std::unique_ptr<FunctionAST> Parser::ParseTopLevelExpr() {
-	if (auto E = ParseExpression()) {
+std::unique_ptr<FunctionAST> Parser::ParseTopLevelExpr(std::unique_ptr<ExprAST> LHS) {
+	auto E = LHS ? ParseBinOpRHS(0, std::move(LHS)) : ParseExpression();
+	if (E) {
 		// Make an anonymous proto.
 		auto Proto = std::make_unique<PrototypeAST>("__anon_expr", std::vector<std::string>());
 		return std::make_unique<FunctionAST>(std::move(Proto), std::move(E));
@@ -195,6 +312,33 @@ std::unique_ptr<FunctionAST> Parser::ParseTopLevelExpr() {
 	return nullptr;
 }
 
+std::unique_ptr<FunctionAST> Parser::ParseConst(std::string& Name) {
+	if (curTok.token != tok_identifier) {
+		LogError::LogErrorBase("expected identifier after const");
+		return nullptr;
+	}
+	Name = curTok.identifierStr;
+	getNextToken();  // eat identifier.
+
+	if (curTok.thisChar != '=') {
+		LogError::LogErrorBase("expected '=' after const");
+		return nullptr;
+	}
+	getNextToken();  // eat '='.
+
+	return ParseTopLevelExpr();
+}
+
+bool Parser::ParseLoad(std::string& Path) {
+	if (curTok.token != tok_string) {
+		LogError::LogErrorBase("expected file name after load");
+		return false;
+	}
+	Path = curTok.identifierStr;
+	getNextToken();  // eat file name.
+	return true;
+}
+
 std::unique_ptr<ExprAST> Parser::ParseIfExpr()
 {
 	getNextToken();  // eat the if.
@@ -273,6 +417,121 @@ std::unique_ptr<ExprAST> Parser::ParseForExpr()
 		std::move(Body));
 }
 
+std::unique_ptr<ExprAST> Parser::ParseParallelForExpr()
+{
+	getNextToken();  // eat the for.
+
+	if (curTok.token != tok_identifier)
+		return LogError::LogError("expected identifier after for");
+
+	std::string IdName = curTok.identifierStr;
+	getNextToken();  // eat identifier.
+
+	if (curTok.thisChar != '=')
+		return LogError::LogError("expected '=' after for");
+	getNextToken();  // eat '='.
+
+	auto Start = ParseExpression();
+	if (!Start)
+		return nullptr;
+	if (curTok.thisChar != ',')
+		return LogError::LogError("expected ',' after for start value");
+	getNextToken();
+
+	// The trip count has to be known before the loop starts, so the end
+	// condition is restricted to 'identifier < expr'.
+	if (curTok.token != tok_identifier || curTok.identifierStr != IdName)
+		return LogError::LogError("expected loop variable in parallel for end condition");
+	getNextToken();  // eat identifier.
+
+	if (curTok.thisChar != '<')
+		return LogError::LogError("expected '<' in parallel for end condition");
+	getNextToken();  // eat '<'.
+
+	auto End = ParseExpression();
+	if (!End)
+		return nullptr;
+
+	// The step value is optional.
+	std::unique_ptr<ExprAST> Step;
+	if (curTok.thisChar == ',') {
+		getNextToken();
+		Step = ParseExpression();
+		if (!Step)
+			return nullptr;
+	}
+
+	if (curTok.token != tok_in)
+		return LogError::LogError("expected 'in' after for");
+	getNextToken();  // eat 'in'.
+
+	auto Body = ParseExpression();
+	if (!Body)
+		return nullptr;
+
+	return llvm::make_unique<ParallelForExprAST>(IdName, std::move(Start),
+		std::move(End), std::move(Step),
+		std::move(Body));
+}
+
+std::unique_ptr<ExprAST> Parser::ParseReductionExpr(ReductionExprAST::Kind Reduction)
+{
+	// The reduction name is already eaten.
+	std::string IdName = curTok.identifierStr;
+	getNextToken();  // eat identifier.
+
+	if (curTok.thisChar != '=')
+		return LogError::LogError("expected '=' after reduction variable");
+	getNextToken();  // eat '='.
+
+	auto Start = ParseExpression();
+	if (!Start)
+		return nullptr;
+	if (curTok.thisChar != ',')
+		return LogError::LogError("expected ',' after reduction start value");
+	getNextToken();
+
+	auto End = ParseExpression();
+	if (!End)
+		return nullptr;
+
+	// The step value is optional.
+	std::unique_ptr<ExprAST> Step;
+	if (curTok.thisChar == ',') {
+		getNextToken();
+		Step = ParseExpression();
+		if (!Step)
+			return nullptr;
+	}
+
+	if (curTok.token != tok_in)
+		return LogError::LogError("expected 'in' after reduction");
+	getNextToken();  // eat 'in'.
+
+	auto Body = ParseExpression();
+	if (!Body)
+		return nullptr;
+
+	return llvm::make_unique<ReductionExprAST>(Reduction, IdName, std::move(Start),
+		std::move(End), std::move(Step), std::move(Body));
+}
+
+std::unique_ptr<ExprAST> Parser::ParseSpawnExpr()
+{
+	auto E = ParseIdentifierExpr();
+	if (!E)
+		return nullptr;
+	auto* Call = dynamic_cast<CallExprAST*>(E.get());
+	if (!Call)
+		return LogError::LogError("expected function call after spawn");
+	Call->setSpawn();
+	return E;
+}
+
+std::unique_ptr<ExprAST> Parser::ParseSyncExpr()
+{
+	return std::make_unique<SyncExprAST>();
+}
 
 void Parser::HandleDefinition() {
 	if (auto FnAST=ParseDefinition()) {
@@ -280,8 +539,13 @@ void Parser::HandleDefinition() {
 			fprintf(stderr, "Read function definition:");
 			FnIR->print(llvm::errs());
 			fprintf(stderr, "\n");
+			if (codeGen->option.wholeProgram)
+				return;
+			std::string Name = FnIR->getName().str();
 			codeGen->addModuleToJit();
 			codeGen->InitializeModuleAndPassManager();
+			codeGen->refreshDependents(Name);
+			codeGen->maybeRecycleContext();
 		}
 	}
 	else {
@@ -305,22 +569,76 @@ void Parser::HandleExtern() {
 	}
 }
 
-void Parser::HandleTopLevelExpression() {
+void Parser::HandleConst() {
+	// Evaluate the value once, later uses get it as a constant.
+	std::string Name;
+	if (auto FnAST = ParseConst(Name)) {
+		// The whole program is not compiled yet, run a copy of what there is.
+		std::unique_ptr<llvm::Module> Program;
+		if (codeGen->option.wholeProgram) {
+			Program = std::move(codeGen->theModule);
+			codeGen->theModule = llvm::CloneModule(*Program);
+		}
+		double Val;
+		if (EvaluateAnonExpr(*FnAST, Val)) {
+			codeGen->constants[Name] = Val;
+			fprintf(stderr, "Read const %s = %f\n", Name.c_str(), Val);
+		}
+		if (Program)
+			codeGen->theModule = std::move(Program);
+	}
+	else {
+		// Skip token for error recovery.
+		getNextToken();
+	}
+}
+
+void Parser::HandleLoad() {
+	std::string Path;
+	if (ParseLoad(Path)) {
+		if (codeGen->loadLibrary(Path))
+			fprintf(stderr, "Loaded library %s\n", Path.c_str());
+	}
+	else {
+		// Skip token for error recovery.
+		getNextToken();
+	}
+}
+
+void Parser::HandleIdentifier() {
+	// 'const' and 'load' are commands only here, and only before what they
+	// take: otherwise the top-level expression starts with a name.
+	std::string IdName = curTok.identifierStr;
+	if (IdName != "const" && IdName != "load") {
+		HandleTopLevelExpression();
+		return;
+	}
+	getNextToken();  // eat const or load.
+	if (IdName == "const" && curTok.token == tok_identifier)
+		HandleConst();
+	else if (IdName == "load" && curTok.token == tok_string)
+		HandleLoad();
+	else if (auto LHS = ParseIdentifierExpr(IdName))
+		HandleTopLevelExpression(std::move(LHS));
+	else
+		// Skip token for error recovery.
+		getNextToken();
+}
+
+void Parser::HandleTopLevelExpression(std::unique_ptr<ExprAST> LHS) {
 	// Evaluate a top-level expression into an anonymous function.
-	if (auto FnAST = ParseTopLevelExpr()) {
-		if (auto* FnIR=FnAST->codegen(*codeGen)) {
-			FnIR->print(llvm::errs());
-			auto H = codeGen->addModuleToJit();
-			codeGen->InitializeModuleAndPassManager();
-			// Search the JIT for the __anon_expr symbol.
-			auto ExprSymbol = codeGen->theJIT->findSymbol("__anon_expr");
-			assert(ExprSymbol && "Function not found");
-			// Get the symbol's address and cast it to the right type (takes no
-			// arguments, returns a double) so we can call it as a native function.
-			double(*FP)() = (double(*)())(intptr_t)llvm::cantFail(ExprSymbol.getAddress());
-			fprintf(stderr, "Evaluated to %f\n", FP());
-			codeGen->removeModuleFromJit(H);
+	if (auto FnAST = ParseTopLevelExpr(std::move(LHS))) {
+		if (codeGen->option.wholeProgram) {
+			// Keep it in the program under a name of its own, it runs at the end.
+			if (auto* FnIR = FnAST->codegen(*codeGen)) {
+				FnIR->setName("__anon_expr." + std::to_string(anonExprs.size()));
+				anonExprs.push_back(FnIR->getName().str());
+			}
+			return;
 		}
+		double Val;
+		if (EvaluateAnonExpr(*FnAST, Val))
+			fprintf(stderr, "Evaluated to %f\n", Val);
 	}
 	else {
 		// Skip token for error recovery.
@@ -328,7 +646,44 @@ void Parser::HandleTopLevelExpression() {
 	}
 }
 
-/// top ::= definition | external | expression | ';'
+bool Parser::EvaluateAnonExpr(FunctionAST& FnAST, double& Result) {
+	auto* FnIR = FnAST.codegen(*codeGen);
+	if (!FnIR)
+		return false;
+	FnIR->print(llvm::errs());
+	auto H = codeGen->addModuleToJit();
+	codeGen->InitializeModuleAndPassManager();
+	Result = CallAnonExpr("__anon_expr");
+	codeGen->removeModuleFromJit(H);
+	codeGen->maybeRecycleContext();
+	return true;
+}
+
+double Parser::CallAnonExpr(const std::string& Name) {
+	// Search the JIT for the symbol.
+	auto ExprSymbol = codeGen->theJIT->findSymbol(Name);
+	assert(ExprSymbol && "Function not found");
+	// Get the symbol's address and cast it to the right type (takes no
+	// arguments, returns the numeric type) so we can call it as a native function.
+	auto Addr = (intptr_t)llvm::cantFail(ExprSymbol.getAddress());
+	if (codeGen->option.useFloat) {
+		float(*FP)() = (float(*)())Addr;
+		return FP();
+	}
+	double(*FP)() = (double(*)())Addr;
+	return FP();
+}
+
+void Parser::HandleWholeProgram() {
+	codeGen->optimizeWholeProgram(anonExprs);
+	codeGen->theModule->print(llvm::errs(), nullptr);
+	codeGen->addModuleToJit();
+	codeGen->InitializeModuleAndPassManager();
+	for (auto& Name : anonExprs)
+		fprintf(stderr, "Evaluated to %f\n", CallAnonExpr(Name));
+}
+
+/// top ::= definition | external | constdef | load | expression | ';'
 
 void Parser::MainLoop() {
 	while (1) {
@@ -342,6 +697,9 @@ void Parser::MainLoop() {
 		case tok_extern:
 			HandleExtern();
 			break;
+		case tok_identifier:
+			HandleIdentifier();
+			break;
 		case tok_none:
 			if (curTok.thisChar == ';') {
 				getNextToken();
@@ -358,6 +716,16 @@ void Parser::Do() {
 	fprintf(stderr, "ready> ");
 	getNextToken();
 	codeGen->InitializeModuleAndPassManager();
+	for (auto& Path : codeGen->option.libs)
+		codeGen->loadLibrary(Path);
 	MainLoop();
-	codeGen->theModule->print(llvm::errs(), nullptr);
+	if (codeGen->option.wholeProgram)
+		HandleWholeProgram();
+	else
+		codeGen->theModule->print(llvm::errs(), nullptr);
+	const std::string& ProfileFile = codeGen->option.profileGenerate;
+	if (!ProfileFile.empty() && !codeGen->profile.write(ProfileFile))
+		LogError::LogErrorBase(("can not write profile " + ProfileFile).c_str());
+	codeGen->reportSpecializations();
+	codeGen->printOptReport();
 }
\ No newline at end of file
@@ -0,0 +1,107 @@
+#include "profile.hpp"
+#include <fstream>
+#include <sstream>
+
+void Profile::retireSpare(const std::string& Name)
+{
+	auto SI = spare.find(Name);
+	if (SI == spare.end())
+		return;
+	Counters& Groups = SI->second.first;
+	for (size_t i = SI->second.second; i < Groups.size(); ++i)
+		retired.push_back(std::move(Groups[i]));
+	spare.erase(SI);
+}
+
+void Profile::beginFunction(const std::string& Name)
+{
+	retireSpare(Name);
+	auto CI = counters.find(Name);
+	if (CI == counters.end())
+		return;
+	spare[Name] = { std::move(CI->second), 0 };
+	counters.erase(CI);
+}
+
+uint64_t* Profile::addCounters(const std::string& Name, unsigned N)
+{
+	Counters& Groups = counters[Name];
+	auto SI = spare.find(Name);
+	if (SI != spare.end()) {
+		size_t& Next = SI->second.second;
+		if (Next < SI->second.first.size() && SI->second.first[Next].size() == N) {
+			Groups.push_back(std::move(SI->second.first[Next++]));
+			return Groups.back().data();
+		}
+		// The definition changed shape, its old counts no longer line up.
+		retireSpare(Name);
+	}
+	Groups.emplace_back(N, 0);
+	return Groups.back().data();
+}
+
+int64_t Profile::getCount(const std::string& Name, unsigned Site) const
+{
+	auto LI = loaded.find(Name);
+	if (LI == loaded.end() || Site >= LI->second.size())
+		return -1;
+	return LI->second[Site];
+}
+
+bool Profile::fits(const std::string& Name, unsigned Sites) const
+{
+	auto LI = loaded.find(Name);
+	return LI == loaded.end() || LI->second.size() == Sites;
+}
+
+bool Profile::getTopValue(const std::string& Name, unsigned Site,
+	uint64_t& Value, uint64_t& Count, uint64_t& Total) const
+{
+	auto LI = loaded.find(Name);
+	if (LI == loaded.end() || Site + ValueTableSize > LI->second.size())
+		return false;
+	const uint64_t* Table = &LI->second[Site];
+	Total = Table[0];
+	Count = 0;
+	for (unsigned i = 0; i != ValueSlots; ++i)
+		if (Table[2 + 2 * i] > Count) {
+			Value = Table[1 + 2 * i];
+			Count = Table[2 + 2 * i];
+		}
+	return Total != 0 && Count != 0;
+}
+
+bool Profile::write(const std::string& FileName) const
+{
+	std::ofstream Out(FileName);
+	if (!Out)
+		return false;
+	for (auto& C : counters) {
+		Out << C.first;
+		for (auto& Group : C.second)
+			for (uint64_t Count : Group)
+				Out << ' ' << Count;
+		Out << '\n';
+	}
+	return bool(Out);
+}
+
+bool Profile::read(const std::string& FileName)
+{
+	std::ifstream In(FileName);
+	if (!In)
+		return false;
+	std::string Line;
+	while (std::getline(In, Line)) {
+		std::istringstream LineStream(Line);
+		std::string Name;
+		if (!(LineStream >> Name))
+			continue;
+		std::vector<uint64_t>& Counts = loaded[Name];
+		Counts.clear();
+		uint64_t Count;
+		while (LineStream >> Count)
+			Counts.push_back(Count);
+	}
+	return true;
+}
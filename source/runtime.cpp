@@ -0,0 +1,369 @@
+#include "runtime.hpp"
+#include "profile.hpp"
+#include <cstdio>
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <thread>
+#include <vector>
+
+namespace {
+
+	/// Task - A unit of work that can be stolen by another thread.
+	struct Task {
+		std::atomic<bool> done{ false };
+
+		virtual ~Task() {}
+		virtual void execute() = 0;
+
+		void run() {
+			execute();
+			done.store(true, std::memory_order_release);
+		}
+		bool isDone() const { return done.load(std::memory_order_acquire); }
+	};
+
+	/// WorkStealingDeque - Chase-Lev deque.  The owning thread pushes and pops
+	/// at the bottom, other threads steal from the top without taking a lock.
+	class WorkStealingDeque {
+		struct Array {
+			int64_t capacity;
+			std::unique_ptr<std::atomic<Task*>[]> slots;
+
+			explicit Array(int64_t capacity)
+				: capacity(capacity), slots(new std::atomic<Task*>[capacity]) {}
+
+			Task* get(int64_t i) const {
+				return slots[i & (capacity - 1)].load(std::memory_order_relaxed);
+			}
+			void put(int64_t i, Task* task) {
+				slots[i & (capacity - 1)].store(task, std::memory_order_relaxed);
+			}
+		};
+
+		std::atomic<int64_t> top{ 0 };
+		std::atomic<int64_t> bottom{ 0 };
+		std::atomic<Array*> array;
+		/// arrays - Every buffer ever used.  A thief may still read an old one
+		/// after a resize, so they are only released with the deque.
+		std::vector<std::unique_ptr<Array>> arrays;
+
+	public:
+		WorkStealingDeque() {
+			arrays.emplace_back(new Array(64));
+			array.store(arrays.back().get(), std::memory_order_relaxed);
+		}
+
+		/// push - Owner only.
+		void push(Task* task) {
+			int64_t b = bottom.load(std::memory_order_relaxed);
+			int64_t t = top.load(std::memory_order_acquire);
+			Array* a = array.load(std::memory_order_relaxed);
+			if (b - t > a->capacity - 1) {
+				auto* grown = new Array(a->capacity * 2);
+				for (int64_t i = t; i < b; ++i)
+					grown->put(i, a->get(i));
+				arrays.emplace_back(grown);
+				array.store(grown, std::memory_order_release);
+				a = grown;
+			}
+			a->put(b, task);
+			bottom.store(b + 1, std::memory_order_release);
+		}
+
+		/// pop - Owner only, takes the most recently pushed task.
+		Task* pop() {
+			int64_t b = bottom.load(std::memory_order_relaxed) - 1;
+			Array* a = array.load(std::memory_order_relaxed);
+			bottom.store(b, std::memory_order_relaxed);
+			std::atomic_thread_fence(std::memory_order_seq_cst);
+			int64_t t = top.load(std::memory_order_relaxed);
+			if (t > b) {
+				// Empty.
+				bottom.store(b + 1, std::memory_order_relaxed);
+				return nullptr;
+			}
+			Task* task = a->get(b);
+			if (t == b) {
+				// Last element, race against thieves for it.
+				if (!top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst,
+					std::memory_order_relaxed))
+					task = nullptr;
+				bottom.store(b + 1, std::memory_order_relaxed);
+			}
+			return task;
+		}
+
+		/// size - Tasks waiting, exact for the owner only.
+		int64_t size() const {
+			return bottom.load(std::memory_order_relaxed) - top.load(std::memory_order_relaxed);
+		}
+
+		/// steal - Any thread, takes the oldest task.
+		Task* steal() {
+			int64_t t = top.load(std::memory_order_acquire);
+			std::atomic_thread_fence(std::memory_order_seq_cst);
+			int64_t b = bottom.load(std::memory_order_acquire);
+			if (t >= b)
+				return nullptr;
+			Array* a = array.load(std::memory_order_acquire);
+			Task* task = a->get(t);
+			if (!top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst,
+				std::memory_order_relaxed))
+				return nullptr;
+			return task;
+		}
+	};
+
+	/// Scheduler - Worker threads, started on first use, plus one deque for
+	/// every thread that spawned work.  Threads waiting for a task keep running
+	/// other tasks, so nested spawns and parallel fors cannot dead lock.
+	class Scheduler {
+		static const int MaxDeques = 256;
+		/// QueuedPerThread - Tasks waiting in a deque, per thread, past which
+		/// the threads have enough work.
+		static const int QueuedPerThread = 2;
+
+		std::array<std::atomic<WorkStealingDeque*>, MaxDeques> deques;
+		std::atomic<int> dequeCount{ 0 };
+		std::vector<std::unique_ptr<WorkStealingDeque>> ownedDeques;
+		std::mutex mutex;
+		std::condition_variable wake;
+		std::atomic<int> sleeping{ 0 };
+		std::atomic<bool> stop{ false };
+		std::vector<std::thread> workers;
+
+		/// getLocalDeque - The calling thread's deque, null if we ran out.
+		WorkStealingDeque* getLocalDeque() {
+			thread_local WorkStealingDeque* local = nullptr;
+			thread_local bool registered = false;
+			if (!registered) {
+				registered = true;
+				std::lock_guard<std::mutex> lock(mutex);
+				int index = dequeCount.load();
+				if (index < MaxDeques) {
+					ownedDeques.emplace_back(new WorkStealingDeque());
+					local = ownedDeques.back().get();
+					deques[index].store(local);
+					dequeCount.store(index + 1);
+				}
+			}
+			return local;
+		}
+
+		Task* findTask(WorkStealingDeque* local) {
+			if (local)
+				if (Task* task = local->pop())
+					return task;
+			thread_local std::minstd_rand random(std::hash<std::thread::id>()(std::this_thread::get_id()));
+			int count = dequeCount.load();
+			int start = count ? random() % count : 0;
+			for (int i = 0; i < count; ++i) {
+				WorkStealingDeque* victim = deques[(start + i) % count].load();
+				if (victim != local)
+					if (Task* task = victim->steal())
+						return task;
+			}
+			return nullptr;
+		}
+
+		void workerLoop() {
+			WorkStealingDeque* local = getLocalDeque();
+			while (!stop.load()) {
+				if (Task* task = findTask(local)) {
+					task->run();
+					continue;
+				}
+				// Nothing to do, doze off until new work is pushed.
+				std::unique_lock<std::mutex> lock(mutex);
+				++sleeping;
+				wake.wait_for(lock, std::chrono::milliseconds(1));
+				--sleeping;
+			}
+		}
+
+	public:
+		Scheduler() {
+			unsigned n = std::max(std::thread::hardware_concurrency(), 1u);
+			for (unsigned i = 1; i < n; ++i)
+				workers.emplace_back([this] { workerLoop(); });
+		}
+
+		~Scheduler() {
+			stop.store(true);
+			wake.notify_all();
+			for (auto& worker : workers)
+				worker.join();
+		}
+
+		unsigned size() const { return workers.size() + 1; }
+
+		/// spawn - Make the task available to every thread.  Threads without a
+		/// deque just run it on the spot.
+		void spawn(Task* task) {
+			WorkStealingDeque* local = getLocalDeque();
+			if (!local) {
+				task->run();
+				return;
+			}
+			local->push(task);
+			if (sleeping.load() > 0)
+				wake.notify_one();
+		}
+
+		/// isSaturated - The calling thread has enough tasks waiting to keep
+		/// every thread busy, or no deque to queue more.
+		bool isSaturated() {
+			WorkStealingDeque* local = getLocalDeque();
+			return !local || local->size() >= int64_t(size()) * QueuedPerThread;
+		}
+
+		/// join - Wait for the task, running other tasks in the meantime.
+		void join(Task* task) {
+			WorkStealingDeque* local = getLocalDeque();
+			while (!task->isDone()) {
+				if (Task* other = findTask(local))
+					other->run();
+				else
+					std::this_thread::yield();
+			}
+		}
+	};
+
+	Scheduler& getScheduler() {
+		static Scheduler scheduler;
+		return scheduler;
+	}
+
+	/// ChunkTask - The iterations [begin, end) of a parallel for.
+	struct ChunkTask : Task {
+		void(*body)(int64_t, int64_t, void*);
+		int64_t begin, end;
+		void* env;
+
+		void execute() override { body(begin, end, env); }
+	};
+
+	/// CallTask - A spawned Kaleidoscope call, see kaleido_spawn.
+	struct CallTask : Task {
+		double(*thunk)(const double*);
+		std::vector<double> args;
+		double result = 0;
+
+		void execute() override { result = thunk(args.data()); }
+	};
+
+	/// SpawnFrame - The tasks spawned by one activation of a function.
+	struct SpawnFrame {
+		std::vector<std::unique_ptr<CallTask>> tasks;
+
+		void sync() {
+			for (auto& task : tasks)
+				getScheduler().join(task.get());
+		}
+	};
+}
+
+extern "C" DLLEXPORT void kaleido_parallel_for(
+	void(*Body)(int64_t, int64_t, void*), int64_t Count, void* Env)
+{
+	if (Count <= 0)
+		return;
+	auto& scheduler = getScheduler();
+	// A few chunks per thread keeps the threads busy when iterations are uneven.
+	int64_t chunk = std::max<int64_t>(1, Count / (scheduler.size() * 4));
+	std::vector<ChunkTask> chunks((Count + chunk - 1) / chunk);
+	for (size_t i = 0; i < chunks.size(); ++i) {
+		chunks[i].body = Body;
+		chunks[i].begin = i * chunk;
+		chunks[i].end = std::min<int64_t>((i + 1) * chunk, Count);
+		chunks[i].env = Env;
+	}
+	// Push in reverse so this thread pops the first chunk first.
+	for (size_t i = chunks.size(); i-- > 0;)
+		scheduler.spawn(&chunks[i]);
+	for (auto& task : chunks)
+		scheduler.join(&task);
+}
+
+extern "C" DLLEXPORT void* kaleido_frame_enter()
+{
+	return new SpawnFrame();
+}
+
+extern "C" DLLEXPORT void* kaleido_spawn(
+	void* Frame, double(*Thunk)(const double*), const double* Args, int64_t NumArgs)
+{
+	auto* frame = static_cast<SpawnFrame*>(Frame);
+	auto* task = new CallTask();
+	task->thunk = Thunk;
+	task->args.assign(Args, Args + NumArgs);
+	frame->tasks.emplace_back(task);
+	// Once the threads have enough work, the call is made on the spot, so a
+	// recursion spawning at every level does not queue a task per call.
+	auto& scheduler = getScheduler();
+	if (scheduler.isSaturated())
+		task->run();
+	else
+		scheduler.spawn(task);
+	return task;
+}
+
+extern "C" DLLEXPORT double kaleido_join(void* Task)
+{
+	auto* task = static_cast<CallTask*>(Task);
+	getScheduler().join(task);
+	return task->result;
+}
+
+extern "C" DLLEXPORT void kaleido_sync(void* Frame)
+{
+	static_cast<SpawnFrame*>(Frame)->sync();
+}
+
+extern "C" DLLEXPORT void kaleido_frame_leave(void* Frame)
+{
+	auto* frame = static_cast<SpawnFrame*>(Frame);
+	frame->sync();
+	delete frame;
+}
+
+extern "C" DLLEXPORT void kaleido_profile_value(uint64_t* Table, uint64_t Value)
+{
+	// Misra-Gries: a value seen in more than 1/(ValueSlots+1) of the calls is
+	// sure to keep its slot.  Racing parallel loop bodies may lose updates,
+	// the counts only need to be roughly right.
+	++Table[0];
+	uint64_t* Free = nullptr;
+	for (unsigned i = 0; i != Profile::ValueSlots; ++i) {
+		uint64_t* Slot = &Table[1 + 2 * i];
+		if (Slot[1] && Slot[0] == Value) {
+			++Slot[1];
+			return;
+		}
+		if (!Slot[1] && !Free)
+			Free = Slot;
+	}
+	if (Free) {
+		Free[0] = Value;
+		Free[1] = 1;
+		return;
+	}
+	for (unsigned i = 0; i != Profile::ValueSlots; ++i)
+		--Table[2 + 2 * i];
+}
+
+extern "C" DLLEXPORT void kaleido_print_char(int32_t C)
+{
+	fputc(C, stderr);
+}
+
+extern "C" DLLEXPORT void kaleido_print_double(double X)
+{
+	fprintf(stderr, "%f\n", X);
+}
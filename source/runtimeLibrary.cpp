@@ -0,0 +1,85 @@
+#include "runtimeLibrary.hpp"
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/IRBuilder.h"
+
+const std::vector<std::string>& getRuntimeFunctions()
+{
+	static const std::vector<std::string> Names = {
+		"putchard", "printd", "min", "max", "clamp", "sign", "lerp"
+	};
+	return Names;
+}
+
+/// createRuntimeFunction - Start the definition of double Name(double...) with
+/// NumArgs arguments, with B at the end of its entry block.
+static llvm::Function* createRuntimeFunction(llvm::Module& M, llvm::IRBuilder<>& B,
+	const std::string& Name, unsigned NumArgs) {
+	llvm::Type* DoubleTy = B.getDoubleTy();
+	llvm::FunctionType* FT = llvm::FunctionType::get(DoubleTy,
+		std::vector<llvm::Type*>(NumArgs, DoubleTy), false);
+	llvm::Function* F = llvm::Function::Create(FT, llvm::Function::ExternalLinkage, Name, &M);
+	F->addFnAttr(llvm::Attribute::NoUnwind);
+	B.SetInsertPoint(llvm::BasicBlock::Create(M.getContext(), "entry", F));
+	return F;
+}
+
+/// emitPrint - Body of putchard or printd, handing X to the host function Host.
+static void emitPrint(llvm::Module& M, llvm::IRBuilder<>& B, const std::string& Name,
+	const char* Host, llvm::Type* HostArgTy) {
+	llvm::Function* F = createRuntimeFunction(M, B, Name, 1);
+	llvm::Value* X = &*F->arg_begin();
+	llvm::FunctionType* HostFT = llvm::FunctionType::get(B.getVoidTy(), { HostArgTy }, false);
+	llvm::Constant* HostF = M.getOrInsertFunction(Host, HostFT);
+	// (char)(int)X, passed on as an int.  Converting straight to i8 would be
+	// poison outside [-128, 127].
+	if (HostArgTy->isIntegerTy())
+		X = B.CreateSExt(B.CreateTrunc(B.CreateFPToSI(X, B.getInt32Ty()), B.getInt8Ty()), HostArgTy);
+	B.CreateCall(HostF, { X });
+	B.CreateRet(llvm::ConstantFP::get(B.getDoubleTy(), 0.0));
+}
+
+/// emitHelper - Definition of the numeric helper Name.
+static void emitHelper(llvm::Module& M, llvm::IRBuilder<>& B, const std::string& Name) {
+	unsigned NumArgs = Name == "sign" ? 1 : Name == "clamp" || Name == "lerp" ? 3 : 2;
+	llvm::Function* F = createRuntimeFunction(M, B, Name, NumArgs);
+	F->addFnAttr(llvm::Attribute::ReadNone);
+	std::vector<llvm::Value*> Args;
+	for (auto& Arg : F->args())
+		Args.push_back(&Arg);
+
+	llvm::Value* Result;
+	if (Name == "min")
+		Result = B.CreateSelect(B.CreateFCmpOLT(Args[1], Args[0]), Args[1], Args[0]);
+	else if (Name == "max")
+		Result = B.CreateSelect(B.CreateFCmpOGT(Args[1], Args[0]), Args[1], Args[0]);
+	else if (Name == "clamp") {
+		llvm::Value* Low = B.CreateSelect(B.CreateFCmpOLT(Args[0], Args[1]), Args[1], Args[0]);
+		Result = B.CreateSelect(B.CreateFCmpOGT(Low, Args[2]), Args[2], Low);
+	}
+	else if (Name == "sign") {
+		llvm::Constant* Zero = llvm::ConstantFP::get(B.getDoubleTy(), 0.0);
+		llvm::Value* Negative = B.CreateSelect(B.CreateFCmpOLT(Args[0], Zero),
+			llvm::ConstantFP::get(B.getDoubleTy(), -1.0), Zero);
+		Result = B.CreateSelect(B.CreateFCmpOGT(Args[0], Zero),
+			llvm::ConstantFP::get(B.getDoubleTy(), 1.0), Negative);
+	}
+	else // lerp
+		Result = B.CreateFAdd(Args[0], B.CreateFMul(B.CreateFSub(Args[1], Args[0]), Args[2]));
+	B.CreateRet(Result);
+}
+
+std::unique_ptr<llvm::Module> buildRuntimeLibrary(llvm::LLVMContext& Context,
+	const std::vector<std::string>& Names)
+{
+	auto M = std::make_unique<llvm::Module>("runtime", Context);
+	llvm::IRBuilder<> B(Context);
+	for (auto& Name : Names) {
+		if (Name == "putchard")
+			emitPrint(*M, B, Name, "kaleido_print_char", B.getInt32Ty());
+		else if (Name == "printd")
+			emitPrint(*M, B, Name, "kaleido_print_double", B.getDoubleTy());
+		else
+			emitHelper(*M, B, Name);
+	}
+	return M;
+}
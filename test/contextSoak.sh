@@ -0,0 +1,47 @@
+#!/bin/sh
+# Memory soak of a long session: peak RSS must not grow with the number of
+# top-level expressions, each of which brings constants of its own.
+# Run: sh test/contextSoak.sh path/to/a [N [options]]   (N defaults to 20000)
+# Expected: "ok", the run of 4*N expressions peaking within 10% of the run
+# of N.  With the option -recycle-context=0 the second run peaks higher.
+# The peak is read from /proc, so it runs on Linux only.
+#
+# Definitions are left out on purpose: the JIT keeps the code of every one,
+# so their memory grows whether or not the context is recycled.
+
+A=${1:?usage: contextSoak.sh path/to/a [N] [options]}
+N=${2:-20000}
+[ $# -ge 2 ] && shift 2 || shift 1
+SCRIPT=${TMPDIR:-/tmp}/contextSoak.$$.k
+trap 'rm -f "$SCRIPT"' EXIT
+
+# peak - Peak RSS in kB of running a, with the given options, on Count
+# generated expressions.
+peak() {
+	Count=$1
+	shift
+	awk -v n="$Count" 'BEGIN {
+		print "def soak(x) if x < 0 then 0 - x else x * 2 + 1;"
+		for (i = 0; i < n; i++)
+			printf "soak(%d.25) + %d;\n", i, i
+	}' > "$SCRIPT"
+	"$A" "$@" < "$SCRIPT" > /dev/null 2>&1 &
+	Pid=$!
+	Peak=0
+	# VmHWM only grows; it is gone once a has exited.
+	while Hwm=$(awk '/^VmHWM:/ { print $2 }' /proc/$Pid/status 2>/dev/null) && [ -n "$Hwm" ]; do
+		Peak=$Hwm
+		sleep 0.1
+	done
+	wait $Pid
+	echo "$Peak"
+}
+
+Short=$(peak "$N" "$@")
+Long=$(peak $((N * 4)) "$@")
+echo "peak RSS: $N expressions $Short kB, $((N * 4)) expressions $Long kB"
+if [ "$Long" -gt $((Short + Short / 10)) ]; then
+	echo "grew"
+	exit 1
+fi
+echo "ok"